@@ -15,7 +15,7 @@
  * another task's worth of resources, it makes using awaitable futures
  * troublesome in some occasions.
  *
- * For instance, in this example `aos_jrpc_peer_read` is executed by the
+ * For instance, in this example `aos_jrpc_peer_read_len` is executed by the
  * Websocket task in `ws_on_data`. That in turn executes `jrpc_on_output` when
  * the processing is done, and then `aos_ws_client_send_text` with a generic
  * future. This chain of exeutions is wholly performed by the Websocket task.
@@ -55,7 +55,7 @@ static void ws_event_handler(aos_ws_client_event_t event, void *args) {
 static void ws_on_data(const void *data, size_t data_len) {
   // Pipe data in the JSON-RPC peer
   printf("Websocket client received:%.*s\n", data_len, (char *)data);
-  aos_jrpc_peer_read(_jrpc_peer, data);
+  aos_jrpc_peer_read_len(_jrpc_peer, data, data_len);
 }
 
 static void jrpc_on_error(unsigned int err) {
@@ -15,7 +15,7 @@
  * another task's worth of resources, it makes using awaitable futures
  * non-advisable and even troublesome in some occasions.
  *
- * For instance, in this example `aos_jrpc_server_call` is executed by the
+ * For instance, in this example `aos_jrpc_server_call_len` is executed by the
  * Websocket task in `ws_on_data` using a generic future. If we had used an
  * awaitable and awaited it in-place, the Websocket task would be blocked and
  * incapable of responding to inputs until `jrpc_handler_dosomething` completed,
@@ -67,7 +67,7 @@ static void ws_on_data(const void *data, size_t data_len) {
   aos_future_config_t config = {.cb = aos_jrpc_server_call_cb};
   aos_future_t *call_future =
       AOS_FUTURE_ALLOC_T(aos_jrpc_server_call)(&config, NULL, 0);
-  aos_jrpc_server_call(_jrpc_server, data, call_future);
+  aos_jrpc_server_call_len(_jrpc_server, data, data_len, call_future);
 }
 
 // A generic handler for the "dosomething" method
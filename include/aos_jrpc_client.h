@@ -22,6 +22,7 @@
 #pragma once
 #include <aos.h>
 #include <cJSON.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -38,6 +39,7 @@ typedef struct _aos_jrpc_client_t aos_jrpc_client_t;
 typedef struct aos_jrpc_client_config_t {
   size_t maxrequests; // Maximum number of parallel requests
   size_t maxinputlen; // Maximum input lenght
+  const char *deadlinefield; // Request member carrying timeout_ms, if not NULL
   unsigned int (*on_output)(const char *data); // Output function
 } aos_jrpc_client_config_t;
 
@@ -77,6 +79,19 @@ unsigned int aos_jrpc_client_free(aos_jrpc_client_t *client);
  */
 unsigned int aos_jrpc_client_read(aos_jrpc_client_t *client, const char *data);
 
+/**
+ * @brief Client input function (text of known length)
+ * Same as aos_jrpc_client_read, for input that is not NUL-terminated. Input
+ * longer than maxinputlen is rejected before being read.
+ *
+ * @param client Client instance
+ * @param data Input data
+ * @param len Input data length
+ * @return unsigned int Same as aos_jrpc_client_read
+ */
+unsigned int aos_jrpc_client_read_len(aos_jrpc_client_t *client,
+                                      const char *data, size_t len);
+
 /**
  * @brief Client input function (cJSON)
  * Input data in cJSON format such as responses are ingested through this
@@ -91,6 +106,24 @@ unsigned int aos_jrpc_client_read(aos_jrpc_client_t *client, const char *data);
  */
 unsigned int aos_jrpc_client_read_json(aos_jrpc_client_t *client, cJSON *json);
 
+/**
+ * @brief Client input function (stream)
+ * Streamed input in text format is ingested through this function. Input may
+ * be split anywhere, each response is read as soon as it is complete. Partial
+ * responses are buffered up to maxinputlen. Feed a client from a single task
+ * only.
+ *
+ * @param client Client instance
+ * @param data Input chunk, not necessarily NUL-terminated
+ * @param len Input chunk length
+ * @return unsigned int
+ * 0 if all complete responses are processed correctly.
+ * Otherwise the aos_jrpc_client_read error of the last failing response, 1
+ * also if the input buffer could not be allocated.
+ */
+unsigned int aos_jrpc_client_feed(aos_jrpc_client_t *client, const char *data,
+                                  size_t len);
+
 /**
  * @brief Client error codes
  */
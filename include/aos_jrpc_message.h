@@ -21,6 +21,8 @@
  */
 #pragma once
 #include <cJSON.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,6 +60,18 @@ cJSON *aos_jrpc_message_request(cJSON *id, const char *method, cJSON *params);
  */
 cJSON *aos_jrpc_message_error(cJSON *id, int code, const char *msg);
 
+/**
+ * @brief Print a JSON-RPC error message without building it.
+ * Same output as printing aos_jrpc_message_error unformatted, the ID is the
+ * only part serialized.
+ *
+ * @param id Request ID
+ * @param code Error code
+ * @param msg Error message, printed as is (no escaping)
+ * @return char* Error message string if success, NULL if fail
+ */
+char *aos_jrpc_message_error_print(const cJSON *id, int code, const char *msg);
+
 /**
  * @brief Build a JSON-RPC result message.
  * ID and result are passed by copy.
@@ -68,6 +82,113 @@ cJSON *aos_jrpc_message_error(cJSON *id, int code, const char *msg);
  */
 cJSON *aos_jrpc_message_result(cJSON *id, cJSON *result);
 
+/**
+ * @brief Write a JSON-RPC result message into a buffer.
+ * Same output as printing aos_jrpc_message_result unformatted, the result is
+ * printed in place without being copied. As with cJSON_PrintPreallocated,
+ * leave a few bytes of slack.
+ *
+ * @param id Request ID
+ * @param result Result
+ * @param buf Output buffer
+ * @param size Output buffer size
+ * @return int Message length if success, -1 if fail or the buffer is too small
+ */
+int aos_jrpc_message_result_write(const cJSON *id, const cJSON *result,
+                                  char *buf, size_t size);
+
+/**
+ * @brief Print a JSON-RPC result message without building it.
+ * Same output as printing aos_jrpc_message_result unformatted, the result is
+ * printed in place without being copied.
+ *
+ * @param id Request ID
+ * @param result Result
+ * @return char* Result message string if success, NULL if fail
+ */
+char *aos_jrpc_message_result_print(const cJSON *id, const cJSON *result);
+
+/**
+ * @brief Print a JSON-RPC result message around a pre-serialized result.
+ * The result is spliced in verbatim, see aos_jrpc_message_isvalid to check it.
+ *
+ * @param id Request ID
+ * @param raw Serialized result
+ * @return char* Result message string if success, NULL if fail
+ */
+char *aos_jrpc_message_result_raw_print(const cJSON *id, const char *raw);
+
+/**
+ * @brief Check a JSON text is a single valid value.
+ * Syntax only, nothing is allocated.
+ *
+ * @param data JSON text, not necessarily NUL-terminated
+ * @param len JSON text length
+ * @return bool true if valid, false otherwise
+ */
+bool aos_jrpc_message_isvalid(const char *data, size_t len);
+
+/**
+ * @brief Incremental message scanner
+ * Splits a byte stream into complete top-level JSON values, keeping the
+ * partial message across chunks in a buffer bounded by the maximum message
+ * length. Whitespace between messages is skipped. Top-level strings end at
+ * their closing quote, anything else than an object or an array at the next
+ * whitespace, outside of quotes.
+ */
+typedef struct aos_jrpc_message_scanner_t {
+  char *buf;     // Current message, NUL-terminated once complete
+  size_t len;    // Current message length
+  size_t maxlen; // Maximum message length
+  size_t depth;  // Open objects and arrays
+  bool string;   // Inside a string
+  bool escape;   // Inside a string, after a backslash
+  bool bare;     // Inside a message that is not an object, array or string
+  bool overflow; // Current message is longer than maxlen
+  bool done;     // Current message is complete
+} aos_jrpc_message_scanner_t;
+
+/**
+ * @brief Message scanner state
+ */
+typedef enum aos_jrpc_message_scan_t {
+  AOS_JRPC_MESSAGE_SCAN_PARTIAL = 0, // Input consumed, no complete message
+  AOS_JRPC_MESSAGE_SCAN_COMPLETE,    // Message available in the buffer
+  AOS_JRPC_MESSAGE_SCAN_OVERFLOW,    // Message longer than maxlen, dropped
+} aos_jrpc_message_scan_t;
+
+/**
+ * @brief Initialize a message scanner
+ *
+ * @param scanner Scanner
+ * @param maxlen Maximum message length
+ * @return bool true if success, false if the buffer could not be allocated
+ */
+bool aos_jrpc_message_scanner_init(aos_jrpc_message_scanner_t *scanner,
+                                   size_t maxlen);
+
+/**
+ * @brief Release a message scanner buffer
+ *
+ * @param scanner Scanner
+ */
+void aos_jrpc_message_scanner_deinit(aos_jrpc_message_scanner_t *scanner);
+
+/**
+ * @brief Scan input up to the end of the next message
+ * Call again with the remaining input until it is all consumed. A complete
+ * message stays in the scanner buffer until the next call.
+ *
+ * @param scanner Scanner
+ * @param data Input chunk, not necessarily NUL-terminated
+ * @param len Input chunk length
+ * @param consumed Input bytes consumed
+ * @return aos_jrpc_message_scan_t Scanner state
+ */
+aos_jrpc_message_scan_t
+aos_jrpc_message_scan(aos_jrpc_message_scanner_t *scanner, const char *data,
+                      size_t len, size_t *consumed);
+
 #ifdef __cplusplus
 }
 #endif
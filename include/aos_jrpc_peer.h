@@ -21,6 +21,7 @@
  */
 #pragma once
 #include <aos_jrpc_client.h>
+#include <aos_jrpc_message.h>
 #include <aos_jrpc_server.h>
 #include <cJSON.h>
 
@@ -38,6 +39,7 @@ typedef struct aos_jrpc_peer_config_t {
   size_t maxclientrequests; // Maximum client parallel requests
   size_t maxserverrequests; // Maximum server parallel requests
   bool parallel; // Process batch requests concurrently rather than sequentially
+  const char *deadlinefield; // Request member carrying the client timeout
 } aos_jrpc_peer_config_t;
 
 /**
@@ -47,6 +49,7 @@ typedef struct aos_jrpc_peer_t {
   aos_jrpc_server_t *server;
   aos_jrpc_client_t *client;
   aos_jrpc_peer_config_t config;
+  aos_jrpc_message_scanner_t scanner; // Fed input, allocated on first use
 } aos_jrpc_peer_t;
 
 /**
@@ -84,6 +87,20 @@ unsigned int aos_jrpc_peer_free(aos_jrpc_peer_t *peer);
  */
 unsigned int aos_jrpc_peer_read(aos_jrpc_peer_t *peer, const char *data);
 
+/**
+ * @brief Peer input function (text of known length)
+ * Same as aos_jrpc_peer_read, for input that is not NUL-terminated such as
+ * transport payloads. Input longer than maxinputlen is rejected before being
+ * read.
+ *
+ * @param peer Peer instance
+ * @param data Input data
+ * @param len Input data length
+ * @return unsigned int Same as aos_jrpc_peer_read
+ */
+unsigned int aos_jrpc_peer_read_len(aos_jrpc_peer_t *peer, const char *data,
+                                    size_t len);
+
 /**
  * @brief Peer input function (json)
  * Input data in json format such as responses are ingested through this
@@ -99,6 +116,24 @@ unsigned int aos_jrpc_peer_read(aos_jrpc_peer_t *peer, const char *data);
  */
 unsigned int aos_jrpc_peer_read_json(aos_jrpc_peer_t *peer, cJSON *json);
 
+/**
+ * @brief Peer input function (stream)
+ * Streamed input in text format is ingested through this function. Input may
+ * be split anywhere, each message is read as soon as it is complete. Partial
+ * messages are buffered up to maxinputlen, longer ones get a -32000 error
+ * response once they end. Feed a peer from a single task only.
+ *
+ * @param peer Peer instance
+ * @param data Input chunk, not necessarily NUL-terminated
+ * @param len Input chunk length
+ * @return unsigned int
+ * 0 if all complete messages are processed correctly.
+ * Otherwise the aos_jrpc_peer_read error of the last failing message, 1 also
+ * if the input buffer could not be allocated.
+ */
+unsigned int aos_jrpc_peer_feed(aos_jrpc_peer_t *peer, const char *data,
+                                size_t len);
+
 #ifdef __cplusplus
 }
 #endif
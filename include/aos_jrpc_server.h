@@ -32,19 +32,131 @@ extern "C" {
  */
 typedef struct _aos_jrpc_server_t aos_jrpc_server_t;
 
+/**
+ * @brief Request priority classes
+ * Each class has its own task and worker pool queues, served highest first.
+ */
+typedef enum aos_jrpc_server_priority_t {
+  AOS_JRPC_SERVER_PRIORITY_NORMAL = 0,
+  AOS_JRPC_SERVER_PRIORITY_HIGH,
+  AOS_JRPC_SERVER_PRIORITIES, // Number of classes
+} aos_jrpc_server_priority_t;
+
+/**
+ * @brief JSON-RPC server task configuration
+ * @param queuelen Maximum queued inputs (no task if 0)
+ * @param stacksize Task stack size
+ * @param priority Task priority
+ * @param core Core the task is pinned to (no affinity if negative)
+ * @param on_output Output callback, takes ownership of the textual response.
+ * Also receives the responses to input fed through aos_jrpc_server_feed.
+ * @param ctx Output callback context
+ */
+typedef struct aos_jrpc_server_task_config_t {
+  size_t queuelen;
+  size_t stacksize;
+  unsigned int priority;
+  int core;
+  void (*on_output)(char *data, void *ctx);
+  void *ctx;
+} aos_jrpc_server_task_config_t;
+
+/**
+ * @brief JSON-RPC server worker pool configuration
+ * @param workers Number of workers, pinned round-robin across cores (no pool
+ * if 0)
+ * @param stacksize Worker stack size
+ * @param priority Worker priority
+ */
+typedef struct aos_jrpc_server_pool_config_t {
+  size_t workers;
+  size_t stacksize;
+  unsigned int priority;
+} aos_jrpc_server_pool_config_t;
+
+/**
+ * @brief JSON-RPC server timeout reaper configuration
+ * The reaper answers timed out requests, running output callbacks and
+ * sequential batch continuations.
+ * @param stacksize Reaper stack size
+ * @param priority Reaper priority
+ */
+typedef struct aos_jrpc_server_reaper_config_t {
+  size_t stacksize;
+  unsigned int priority;
+} aos_jrpc_server_reaper_config_t;
+
 /**
  * @brief JSON-RPC server configuration
  * @param maxrequests Maximum parallel requests
  * @param maxinputlen Maximum input string length
+ * @param timeout Default handler execution time limit in milliseconds, past
+ * which a -32005 error response is sent (none if 0). Timed out requests are
+ * answered from a reaper task started along with the first timeout, so caller
+ * continuations never run on the esp_timer task.
+ * @param reserved Request slots only high priority requests can take, must be
+ * lower than maxrequests
+ * @param priorityfield Request member overriding the method priority class
+ * with its numeric value (ignored if NULL)
+ * @param deadlinefield Request member carrying the time in milliseconds the
+ * client is still willing to wait (ignored if NULL). The budget counts from
+ * the message arrival (call, push or feed), so time spent in the task queue or
+ * behind earlier batch items is included. Requests whose budget runs out
+ * before their handler starts get a -32006 error response instead. Only
+ * relative budgets are supported, as peers do not share a synchronized clock
+ * to compare absolute timestamps against.
  * @param sequential Enforce sequential processing of batch requests (batch
  * response will follow the same order)
+ * @param window Maximum items of a parallel batch in flight at once, the next
+ * one starts as each completes (all at once if 0)
+ * @param shutdowncode Error code replied to requests received after shutdown
+ * (-32003 if 0)
+ * @param arena Block size in bytes of the arena textual requests are parsed
+ * into, released as a whole once dispatched (parse on the heap if 0). Needs
+ * aos_jrpc_server_arena_install, requests are parsed on the heap until then.
+ * @param batches Batch contexts preallocated along with the server, further
+ * concurrent batches are allocated on the heap
+ * @param batchitems Items a preallocated parallel batch context can hold,
+ * longer batches are allocated on the heap
+ * @param paramspace Bytes a preallocated request context holds for the bound
+ * parameter struct and the strings copied for it, larger calls are allocated
+ * on the heap
+ * @param task Task variant configuration
+ * @param pool Worker pool configuration, for handlers registered as pooled
+ * @param reaper Timeout reaper task configuration
  */
 typedef struct aos_jrpc_server_config_t {
   size_t maxrequests;
   size_t maxinputlen;
+  uint32_t timeout;
+  size_t reserved;
+  const char *priorityfield;
+  const char *deadlinefield;
   bool parallel;
+  size_t window;
+  int shutdowncode;
+  size_t arena;
+  size_t batches;
+  size_t batchitems;
+  size_t paramspace;
+  aos_jrpc_server_task_config_t task;
+  aos_jrpc_server_pool_config_t pool;
+  aos_jrpc_server_reaper_config_t reaper;
 } aos_jrpc_server_config_t;
 
+/**
+ * @brief Install the cJSON allocation hooks request arenas are served through
+ * cJSON hooks are process-wide and cannot be removed, so servers never install
+ * them on their own. Every cJSON allocation in the firmware goes through them
+ * from then on, including other components. They fall back to malloc/free
+ * unless a request is being parsed on the calling task, but cJSON_Print* loses
+ * its realloc fast path for everybody. Only parse trees come from arenas, ids,
+ * responses and their prints outlive the call and stay on the heap. Do not
+ * call it if other components install their own cJSON hooks.
+ * @note Calling it more than once has no further effect
+ */
+void aos_jrpc_server_arena_install(void);
+
 /**
  * @brief Allocate a new JSON-RPC server instance
  *
@@ -53,15 +165,57 @@ typedef struct aos_jrpc_server_config_t {
  */
 aos_jrpc_server_t *aos_jrpc_server_alloc(aos_jrpc_server_config_t *config);
 
+AOS_DECLARE(aos_jrpc_server_shutdown, unsigned int out_err)
+/**
+ * @brief Shut down server
+ * Stop admitting requests, which get an error response with the configured
+ * shutdown code from now on, and wait for all requests in flight to complete.
+ * The server can be safely freed once the future is resolved.
+ *
+ * @param server Server instance
+ * @param future Future
+ * @param out_err (on future) 1 if another shutdown is pending, 0 otherwise
+ */
+void aos_jrpc_server_shutdown(aos_jrpc_server_t *server,
+                              aos_future_t *future);
+
 /**
  * @brief Free server instance
- * @warning Due to current limitations it is necessary to manually ensure that
- * all requests have completed processing before freeing the server.
+ * @warning Requests still in flight will access a freed server. Shut down the
+ * server with aos_jrpc_server_shutdown first if any request could be. The
+ * server task, if any, is stopped after processing queued inputs.
  *
  * @param server Server instance
  */
 void aos_jrpc_server_free(aos_jrpc_server_t *server);
 
+/**
+ * @brief JSON-RPC server context cache counters
+ * Request contexts are preallocated for maxrequests, batch contexts as
+ * configured. Misses fall back to the heap. Only the server's own contexts are
+ * cached: parse trees, handler results, printed responses and AsyncRTOS
+ * futures are still allocated for every request.
+ * @param requesthits Request contexts taken from the cache
+ * @param requestmisses Request contexts allocated on the heap
+ * @param batchhits Batch contexts taken from the cache
+ * @param batchmisses Batch contexts allocated on the heap
+ */
+typedef struct aos_jrpc_server_stats_t {
+  size_t requesthits;
+  size_t requestmisses;
+  size_t batchhits;
+  size_t batchmisses;
+} aos_jrpc_server_stats_t;
+
+/**
+ * @brief Get server context cache counters
+ *
+ * @param server Server instance
+ * @param stats Output counters
+ */
+void aos_jrpc_server_stats_get(aos_jrpc_server_t *server,
+                               aos_jrpc_server_stats_t *stats);
+
 AOS_DECLARE(aos_jrpc_server_call_json, cJSON *out_response,
             unsigned int out_err)
 /**
@@ -91,6 +245,64 @@ AOS_DECLARE(aos_jrpc_server_call, char *out_data, unsigned int out_err)
 void aos_jrpc_server_call(aos_jrpc_server_t *server, const char *data,
                           aos_future_t *future);
 
+/**
+ * @brief Call a server function through textual request of known length
+ * Same as aos_jrpc_server_call, for input that is not NUL-terminated. Input
+ * longer than maxinputlen is rejected before being read.
+ *
+ * @param server Server instance
+ * @param data Textual request
+ * @param len Textual request length
+ * @param future aos_jrpc_server_call future
+ */
+void aos_jrpc_server_call_len(aos_jrpc_server_t *server, const char *data,
+                              size_t len, aos_future_t *future);
+
+/**
+ * @brief Push textual request to the server task
+ * Parsing, dispatching and serialization happen on the server task, responses
+ * are delivered to the configured output callback. Only available if the
+ * server was allocated with a task queue.
+ *
+ * @param server Server instance
+ * @param data Dynamically allocated textual request, ownership is transferred
+ * to the server if successful
+ * @return unsigned int 0 if queued, 1 if the queue is full, there is no task,
+ * or data is NULL
+ */
+unsigned int aos_jrpc_server_push(aos_jrpc_server_t *server, char *data);
+
+/**
+ * @brief Push textual request to the server task with a priority class
+ * Same as aos_jrpc_server_push, inputs of higher classes are processed first.
+ *
+ * @param server Server instance
+ * @param data Dynamically allocated textual request, ownership is transferred
+ * to the server if successful
+ * @param priority Priority class
+ * @return unsigned int 0 if queued, 1 if the queue is full, there is no task,
+ * or data is NULL
+ */
+unsigned int aos_jrpc_server_push_priority(aos_jrpc_server_t *server,
+                                           char *data,
+                                           aos_jrpc_server_priority_t priority);
+
+/**
+ * @brief Feed a chunk of streamed textual input
+ * Input may be split anywhere, each request is dispatched from the calling
+ * task as soon as it is complete. Responses are delivered to the task output
+ * callback, which is required. Partial requests are buffered up to
+ * maxinputlen, longer ones get a -32000 error response once they end. Feed a
+ * server from a single task only.
+ *
+ * @param server Server instance
+ * @param data Input chunk, not necessarily NUL-terminated
+ * @param len Input chunk length
+ * @return unsigned int 0 if all complete requests were dispatched, 1 otherwise
+ */
+unsigned int aos_jrpc_server_feed(aos_jrpc_server_t *server, const char *data,
+                                  size_t len);
+
 /**
  * @brief Handler error code
  */
@@ -100,18 +312,25 @@ typedef enum aos_jrpc_server_err_t {
                                      // parameters
 } aos_jrpc_server_err_t;
 
-AOS_DECLARE(aos_jrpc_server_handler, cJSON *out_result,
-            aos_jrpc_server_err_t out_err)
+AOS_DECLARE(aos_jrpc_server_handler, const void *in_params,
+            cJSON *out_result, aos_jrpc_server_err_t out_err, char *out_raw)
 /**
  * @brief JSON-RPC handler prototype
  * @param params Parameter structure
  * @param future Future
+ * @param in_params Parameters bound by the handler descriptors (NULL if none).
+ * The struct and the params its members reference are valid until the future
+ * is resolved.
  * @param out_result (on future) cJSON result
  * @param out_err (on future) Error
+ * @param out_raw (on future) Serialized result, spliced verbatim into the
+ * response in place of out_result and freed by the server. cJSON responses
+ * carry it as a raw item.
  * @attention
  * A JSON-RPC handler must behave as follows:
  * 1. Extract relevant parameters from the parameter structure using
- * aos_jrpc_server_param_* functions
+ * aos_jrpc_server_param_* functions, or read them from in_params if the
+ * handler was registered with parameter descriptors
  * 2. Call the intended function with the extracted parameters
  * 3. Create a cJSON response object reflecting the function outcome
  * 4. Resolve the future
@@ -122,18 +341,116 @@ AOS_DECLARE(aos_jrpc_server_handler, cJSON *out_result,
  */
 typedef void (*aos_jrpc_server_handler_t)(cJSON *params, aos_future_t *future);
 
+/**
+ * @brief Parameter type
+ */
+typedef enum aos_jrpc_server_param_type_t {
+  AOS_JRPC_SERVER_PARAM_UINT8 = 0, // uint8_t
+  AOS_JRPC_SERVER_PARAM_UINT16,    // uint16_t
+  AOS_JRPC_SERVER_PARAM_UINT32,    // uint32_t
+  AOS_JRPC_SERVER_PARAM_UINT64,    // uint64_t
+  AOS_JRPC_SERVER_PARAM_INT8,      // int8_t
+  AOS_JRPC_SERVER_PARAM_INT16,     // int16_t
+  AOS_JRPC_SERVER_PARAM_INT32,     // int32_t
+  AOS_JRPC_SERVER_PARAM_INT64,     // int64_t
+  AOS_JRPC_SERVER_PARAM_FLOAT,     // float
+  AOS_JRPC_SERVER_PARAM_DOUBLE,    // double
+  AOS_JRPC_SERVER_PARAM_STR,       // char *, referencing params
+  AOS_JRPC_SERVER_PARAM_BOOL,      // bool
+  AOS_JRPC_SERVER_PARAM_ARRAY,     // cJSON *, referencing params
+  AOS_JRPC_SERVER_PARAM_OBJECT,    // cJSON *, referencing params
+  AOS_JRPC_SERVER_PARAM_TYPES,     // Number of types
+} aos_jrpc_server_param_type_t;
+
+/**
+ * @brief Parameter descriptor
+ * Descriptors are listed in positional order. String members point to copies
+ * kept in the request context, array and object members to copies of those
+ * params only. Both are valid until the handler future is resolved.
+ *
+ * @param name Parameter name, matched when params are an object (positional
+ * only if NULL)
+ * @param type Parameter type
+ * @param offset Offset of the bound struct member, as given by offsetof
+ * @param optional Leave the member zeroed if the parameter is missing
+ * @param min Lower bound on numbers, or on string, array and object lengths
+ * @param max Upper bound, bounds are only checked if max is greater than min
+ */
+typedef struct aos_jrpc_server_param_t {
+  const char *name;
+  aos_jrpc_server_param_type_t type;
+  size_t offset;
+  bool optional;
+  double min;
+  double max;
+} aos_jrpc_server_param_t;
+
+/**
+ * @brief Handler configuration
+ * @param handler Handler
+ * @param pooled Run the handler on the worker pool instead of the calling task
+ * (params are copied for it). Runs inline if the server has no pool.
+ * @param maxconcurrent Maximum calls in progress at once (unlimited if 0)
+ * @param rate Calls per rate window allowed on average (unlimited if 0)
+ * @param ratewindow Rate window in milliseconds (1000 if 0)
+ * @param burst Calls allowed back to back when rate limited (1 if 0)
+ * Calls over the limits get a -32004 error response right away. Calls rejected
+ * later on, before reaching the handler, give their rate token back.
+ * @param priority Priority class
+ * @param timeout Execution time limit in milliseconds (server default if 0).
+ * Late handler results are dropped. Starts the timeout reaper task if needed.
+ * @param validateraw Check serialized results are valid JSON before splicing
+ * them, replying with an internal error otherwise
+ * @param params Parameter descriptors, bound in a single pass into a zeroed
+ * struct handed to the handler as in_params. Mismatching calls get a -32602
+ * error response without running the handler. The table is not copied.
+ * @param nparams Number of parameter descriptors (no binding if 0, at most 32)
+ * @param paramsize Size of the bound struct
+ */
+typedef struct aos_jrpc_server_handler_config_t {
+  aos_jrpc_server_handler_t handler;
+  bool pooled;
+  size_t maxconcurrent;
+  uint32_t rate;
+  uint32_t ratewindow;
+  uint32_t burst;
+  aos_jrpc_server_priority_t priority;
+  uint32_t timeout;
+  bool validateraw;
+  const aos_jrpc_server_param_t *params;
+  size_t nparams;
+  size_t paramsize;
+} aos_jrpc_server_handler_config_t;
+
 /**
  * @brief Set handler
+ * Handlers can be set and unset while requests are being served. The call
+ * blocks until no request can still be looking up the previous registry.
+ * Handlers set this way run inline.
  *
  * @param server Server instance
  * @param handler Handler
  * @param method Method
- * @return unsigned int 0 if successful, 1 if failed
+ * @return unsigned int 0 if successful, 1 if failed or if handlers are frozen
  */
 unsigned int aos_jrpc_server_handler_set(aos_jrpc_server_t *server,
                                          aos_jrpc_server_handler_t handler,
                                          const char *method);
 
+/**
+ * @brief Set handler with configuration
+ * Same as aos_jrpc_server_handler_set, with per-method options.
+ *
+ * @param server Server instance
+ * @param method Method
+ * @param config Handler configuration
+ * @return unsigned int 0 if successful, 1 if failed, if handlers are frozen or
+ * if parameter descriptors do not fit the bound struct
+ */
+unsigned int aos_jrpc_server_handler_register(
+    aos_jrpc_server_t *server, const char *method,
+    const aos_jrpc_server_handler_config_t *config);
+
 /**
  * @brief Unset handler
  *
@@ -141,10 +458,24 @@ unsigned int aos_jrpc_server_handler_set(aos_jrpc_server_t *server,
  * @param handler Handler
  * @param method Method
  * @return unsigned int 0 if handler got unset, 1 if handler could not be found
+ * or if handlers are frozen
  */
 unsigned int aos_jrpc_server_handler_unset(aos_jrpc_server_t *server,
                                            const char *method);
 
+/**
+ * @brief Freeze handlers
+ * Turn the current handlers into an immutable perfect-hash table allocated in
+ * a single block. Lookups on frozen handlers need at most one string
+ * comparison, plus one per method sharing its 32-bit hash with another (these
+ * are kept aside and probed linearly). Handlers cannot be set or unset anymore
+ * after freezing.
+ *
+ * @param server Server instance
+ * @return unsigned int 0 if successful, 1 if failed or if already frozen
+ */
+unsigned int aos_jrpc_server_handlers_freeze(aos_jrpc_server_t *server);
+
 /**
  * @brief Get UINT8 from parameter struct
  *
@@ -53,6 +53,7 @@ struct _aos_jrpc_client_t {
   aos_jrpc_client_request_entry_t *requests;
   SemaphoreHandle_t semaphore;
   aos_jrpc_client_config_t config;
+  aos_jrpc_message_scanner_t scanner; // Fed input, allocated on first use
 };
 
 typedef struct _aos_jrpc_client_timer_args_t {
@@ -83,6 +84,7 @@ aos_jrpc_client_t *aos_jrpc_client_alloc(aos_jrpc_client_config_t *config) {
                                          : CONFIG_AOS_JRPC_CLIENT_MAXREQUESTS,
       .maxinputlen = config->maxinputlen ? config->maxinputlen
                                          : CONFIG_AOS_JRPC_CLIENT_MAXINPUTLEN,
+      .deadlinefield = config->deadlinefield,
       .on_output = config->on_output};
 
   client = calloc(1, sizeof(aos_jrpc_client_t));
@@ -107,6 +109,7 @@ unsigned int aos_jrpc_client_free(aos_jrpc_client_t *client) {
   if (client->requests) {
     return 1;
   }
+  aos_jrpc_message_scanner_deinit(&client->scanner);
   vSemaphoreDelete(client->semaphore);
   free(client);
   return 0;
@@ -216,6 +219,11 @@ void aos_jrpc_client_request_send_json(aos_jrpc_client_t *client,
   new_entry = calloc(1, sizeof(aos_jrpc_client_request_entry_t));
   id = cJSON_CreateNumber(id_num);
   msg = aos_jrpc_message_request(id, method, params);
+  if (msg && client->config.deadlinefield &&
+      !cJSON_AddNumberToObject(msg, client->config.deadlinefield,
+                               timeout_ms)) {
+    goto _aos_jrpc_client_request_send_json_err;
+  }
   data = cJSON_PrintUnformatted(msg);
   timer_args = calloc(1, sizeof(aos_jrpc_client_timer_args_t));
   esp_timer_create_args_t timer_config = {
@@ -279,11 +287,18 @@ unsigned int aos_jrpc_client_notification_send_json(aos_jrpc_client_t *client,
 }
 
 unsigned int aos_jrpc_client_read(aos_jrpc_client_t *client, const char *data) {
-  if (strlen(data) > client->config.maxinputlen) {
+  // Stop counting past the limit
+  return aos_jrpc_client_read_len(
+      client, data, strnlen(data, client->config.maxinputlen + 1));
+}
+
+unsigned int aos_jrpc_client_read_len(aos_jrpc_client_t *client,
+                                      const char *data, size_t len) {
+  if (len > client->config.maxinputlen) {
     return 1;
   }
 
-  cJSON *json = cJSON_Parse(data);
+  cJSON *json = cJSON_ParseWithLength(data, len);
   if (!json) {
     return 2;
   }
@@ -293,6 +308,35 @@ unsigned int aos_jrpc_client_read(aos_jrpc_client_t *client, const char *data) {
   return ret;
 }
 
+unsigned int aos_jrpc_client_feed(aos_jrpc_client_t *client, const char *data,
+                                  size_t len) {
+  if (!client->scanner.buf &&
+      !aos_jrpc_message_scanner_init(&client->scanner,
+                                     client->config.maxinputlen)) {
+    return 1;
+  }
+
+  unsigned int ret = 0;
+  while (len) {
+    size_t consumed = 0;
+    aos_jrpc_message_scan_t scan =
+        aos_jrpc_message_scan(&client->scanner, data, len, &consumed);
+    data += consumed;
+    len -= consumed;
+
+    if (scan == AOS_JRPC_MESSAGE_SCAN_COMPLETE) {
+      unsigned int read_ret = aos_jrpc_client_read_len(
+          client, client->scanner.buf, client->scanner.len);
+      if (read_ret) {
+        ret = read_ret;
+      }
+    } else if (scan == AOS_JRPC_MESSAGE_SCAN_OVERFLOW) {
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
 unsigned int aos_jrpc_client_read_json(aos_jrpc_client_t *client, cJSON *json) {
   if (!_aos_jrpc_client_isvalid(json)) {
     return 3;
@@ -20,7 +20,55 @@
  *  limitations under the License.
  */
 #include <aos_jrpc_message.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _AOS_JRPC_MESSAGE_PRINTSIZE 256
+
+// Maximum nesting accepted when validating
+#ifdef CJSON_NESTING_LIMIT
+#define _AOS_JRPC_MESSAGE_DEPTH CJSON_NESTING_LIMIT
+#else
+#define _AOS_JRPC_MESSAGE_DEPTH 1000
+#endif
+
+/**
+ * Message ID as spliced into printed messages. Integers, null and plain
+ * strings are written as is, anything else is printed by cJSON.
+ */
+typedef struct _aos_jrpc_message_id_t {
+  const char *str;
+  size_t len;
+  bool quoted;
+  char number[21];
+  char *printed; // Printed by cJSON, NULL if spliced
+} _aos_jrpc_message_id_t;
+
+static const char _aos_jrpc_message_head[] = "{\"jsonrpc\":\"2.0\",\"id\":";
+static const char _aos_jrpc_message_result_head[] = ",\"result\":";
+
+static bool _aos_jrpc_message_id_init(_aos_jrpc_message_id_t *id_str,
+                                      const cJSON *id);
+static void _aos_jrpc_message_id_deinit(_aos_jrpc_message_id_t *id_str);
+static char *_aos_jrpc_message_head_copy(const _aos_jrpc_message_id_t *id_str,
+                                         char *cursor);
+static int _aos_jrpc_message_result_write(const _aos_jrpc_message_id_t *id_str,
+                                          const cJSON *result, char *buf,
+                                          size_t size);
+static char *
+_aos_jrpc_message_result_splice(const _aos_jrpc_message_id_t *id_str,
+                                const char *result);
+static const char *_aos_jrpc_message_ws(const char *p, const char *end);
+static const char *_aos_jrpc_message_string(const char *p, const char *end);
+static const char *_aos_jrpc_message_key(const char *p, const char *end);
+static const char *_aos_jrpc_message_digits(const char *p, const char *end);
+static const char *_aos_jrpc_message_scalar(const char *p, const char *end);
+static size_t _aos_jrpc_message_itoa(long long value, char *buf);
+static bool _aos_jrpc_message_isplain(const char *str);
 
 cJSON *aos_jrpc_message_error(cJSON *id, int code, const char *msg) {
   cJSON *message = cJSON_CreateObject();
@@ -45,6 +93,371 @@ cJSON *aos_jrpc_message_error(cJSON *id, int code, const char *msg) {
   return message;
 }
 
+char *aos_jrpc_message_error_print(const cJSON *id, int code, const char *msg) {
+  _aos_jrpc_message_id_t id_str;
+  if (!_aos_jrpc_message_id_init(&id_str, id)) {
+    return NULL;
+  }
+  char code_str[21];
+  size_t code_len = _aos_jrpc_message_itoa(code, code_str);
+  size_t msg_len = strlen(msg);
+
+  // Constant template pieces around the ID, code and message
+  static const char code_head[] = ",\"error\":{\"code\":";
+  static const char msg_head[] = ",\"message\":\"";
+  static const char tail[] = "\"}}";
+  char *data = malloc(sizeof(_aos_jrpc_message_head) - 1 + id_str.len +
+                      2 * id_str.quoted + sizeof(code_head) - 1 + code_len +
+                      sizeof(msg_head) - 1 + msg_len + sizeof(tail));
+  if (data) {
+    char *cursor = _aos_jrpc_message_head_copy(&id_str, data);
+    memcpy(cursor, code_head, sizeof(code_head) - 1);
+    cursor += sizeof(code_head) - 1;
+    memcpy(cursor, code_str, code_len);
+    cursor += code_len;
+    memcpy(cursor, msg_head, sizeof(msg_head) - 1);
+    cursor += sizeof(msg_head) - 1;
+    memcpy(cursor, msg, msg_len);
+    cursor += msg_len;
+    memcpy(cursor, tail, sizeof(tail)); // Along with the terminator
+  }
+  _aos_jrpc_message_id_deinit(&id_str);
+  return data;
+}
+
+int aos_jrpc_message_result_write(const cJSON *id, const cJSON *result,
+                                  char *buf, size_t size) {
+  _aos_jrpc_message_id_t id_str;
+  if (!id || !result || !_aos_jrpc_message_id_init(&id_str, id)) {
+    return -1;
+  }
+  int len = _aos_jrpc_message_result_write(&id_str, result, buf, size);
+  _aos_jrpc_message_id_deinit(&id_str);
+  return len;
+}
+
+char *aos_jrpc_message_result_print(const cJSON *id, const cJSON *result) {
+  _aos_jrpc_message_id_t id_str;
+  if (!id || !result || !_aos_jrpc_message_id_init(&id_str, id)) {
+    return NULL;
+  }
+
+  // Most results fit a first guess, the buffer doubles for others. Attempts
+  // stop at the end of the buffer, the result is never copied.
+  char *data = NULL;
+  for (size_t size = _AOS_JRPC_MESSAGE_PRINTSIZE; size <= INT_MAX; size *= 2) {
+    data = malloc(size);
+    if (!data) {
+      break;
+    }
+    int len = _aos_jrpc_message_result_write(&id_str, result, data, size);
+    if (len >= 0) {
+      // Give back what a grown buffer has left, shrinking in place
+      if (size > _AOS_JRPC_MESSAGE_PRINTSIZE) {
+        char *shrunk = realloc(data, len + 1);
+        data = shrunk ? shrunk : data;
+      }
+      break;
+    }
+    free(data);
+    data = NULL;
+  }
+  _aos_jrpc_message_id_deinit(&id_str);
+  return data;
+}
+
+char *aos_jrpc_message_result_raw_print(const cJSON *id, const char *raw) {
+  _aos_jrpc_message_id_t id_str;
+  if (!id || !raw || !_aos_jrpc_message_id_init(&id_str, id)) {
+    return NULL;
+  }
+  char *data = _aos_jrpc_message_result_splice(&id_str, raw);
+  _aos_jrpc_message_id_deinit(&id_str);
+  return data;
+}
+
+bool aos_jrpc_message_isvalid(const char *data, size_t len) {
+  // Iterative, one bit per open container tells objects from arrays
+  uint32_t objects[(_AOS_JRPC_MESSAGE_DEPTH + 31) / 32];
+  size_t depth = 0;
+  const char *end = data + len;
+  const char *p = data;
+  bool value = true; // Expecting a value, otherwise what follows one
+  while (true) {
+    p = _aos_jrpc_message_ws(p, end);
+    if (value) {
+      if (p == end) {
+        return false;
+      }
+      if (*p == '{' || *p == '[') {
+        bool object = *p == '{';
+        if (depth == _AOS_JRPC_MESSAGE_DEPTH) {
+          return false;
+        }
+        if (object) {
+          objects[depth / 32] |= 1u << depth % 32;
+        } else {
+          objects[depth / 32] &= ~(1u << depth % 32);
+        }
+        depth++;
+        p = _aos_jrpc_message_ws(p + 1, end);
+        if (p < end && *p == (object ? '}' : ']')) {
+          p++;
+          depth--;
+          value = false;
+        } else if (object) {
+          p = _aos_jrpc_message_key(p, end);
+        }
+      } else {
+        p = _aos_jrpc_message_scalar(p, end);
+        value = false;
+      }
+      if (!p) {
+        return false;
+      }
+      continue;
+    }
+
+    // Value complete, close containers or move on to the next member
+    if (!depth) {
+      return p == end;
+    }
+    bool object = objects[(depth - 1) / 32] & 1u << (depth - 1) % 32;
+    if (p < end && *p == ',') {
+      p = object ? _aos_jrpc_message_key(p + 1, end) : p + 1;
+      value = true;
+    } else if (p < end && *p == (object ? '}' : ']')) {
+      p++;
+      depth--;
+    } else {
+      return false;
+    }
+    if (!p) {
+      return false;
+    }
+  }
+}
+
+static bool _aos_jrpc_message_id_init(_aos_jrpc_message_id_t *id_str,
+                                      const cJSON *id) {
+  id_str->str = "null";
+  id_str->len = 4;
+  id_str->quoted = false;
+  id_str->printed = NULL;
+
+  // Integers are printed without going through double formatting, cJSON
+  // prints them the same way below 1e15
+  if (cJSON_IsNumber(id) && id->valuedouble > -1e15 &&
+      id->valuedouble < 1e15 &&
+      (double)(long long)id->valuedouble == id->valuedouble) {
+    id_str->len =
+        _aos_jrpc_message_itoa((long long)id->valuedouble, id_str->number);
+    id_str->str = id_str->number;
+  } else if (cJSON_IsString(id) && _aos_jrpc_message_isplain(id->valuestring)) {
+    id_str->str = id->valuestring;
+    id_str->len = strlen(id->valuestring);
+    id_str->quoted = true;
+  } else if (id && !cJSON_IsNull(id)) {
+    id_str->printed = cJSON_PrintUnformatted(id);
+    if (!id_str->printed) {
+      return false;
+    }
+    id_str->str = id_str->printed;
+    id_str->len = strlen(id_str->printed);
+  }
+  return true;
+}
+
+static void _aos_jrpc_message_id_deinit(_aos_jrpc_message_id_t *id_str) {
+  cJSON_free(id_str->printed);
+}
+
+static char *_aos_jrpc_message_head_copy(const _aos_jrpc_message_id_t *id_str,
+                                         char *cursor) {
+  // Message head up to the ID included, returns the position past it
+  memcpy(cursor, _aos_jrpc_message_head, sizeof(_aos_jrpc_message_head) - 1);
+  cursor += sizeof(_aos_jrpc_message_head) - 1;
+  if (id_str->quoted) {
+    *cursor++ = '"';
+  }
+  memcpy(cursor, id_str->str, id_str->len);
+  cursor += id_str->len;
+  if (id_str->quoted) {
+    *cursor++ = '"';
+  }
+  return cursor;
+}
+
+static int _aos_jrpc_message_result_write(const _aos_jrpc_message_id_t *id_str,
+                                          const cJSON *result, char *buf,
+                                          size_t size) {
+  size_t prefix = sizeof(_aos_jrpc_message_head) - 1 + id_str->len +
+                  2 * id_str->quoted + sizeof(_aos_jrpc_message_result_head) -
+                  1;
+  if (size > INT_MAX) {
+    size = INT_MAX;
+  }
+  if (size < prefix + 2) {
+    return -1;
+  }
+  char *cursor = _aos_jrpc_message_head_copy(id_str, buf);
+  memcpy(cursor, _aos_jrpc_message_result_head,
+         sizeof(_aos_jrpc_message_result_head) - 1);
+  cursor += sizeof(_aos_jrpc_message_result_head) - 1;
+
+  // Result is printed in place, leaving room for the closing brace
+  if (!cJSON_PrintPreallocated((cJSON *)result, cursor, size - prefix - 1,
+                               false)) {
+    return -1;
+  }
+  cursor += strlen(cursor);
+  memcpy(cursor, "}", 2);
+  return cursor + 1 - buf;
+}
+
+static char *
+_aos_jrpc_message_result_splice(const _aos_jrpc_message_id_t *id_str,
+                                const char *result) {
+  size_t result_len = strlen(result);
+  char *data = malloc(sizeof(_aos_jrpc_message_head) - 1 + id_str->len +
+                      2 * id_str->quoted +
+                      sizeof(_aos_jrpc_message_result_head) - 1 + result_len +
+                      2);
+  if (!data) {
+    return NULL;
+  }
+  char *cursor = _aos_jrpc_message_head_copy(id_str, data);
+  memcpy(cursor, _aos_jrpc_message_result_head,
+         sizeof(_aos_jrpc_message_result_head) - 1);
+  cursor += sizeof(_aos_jrpc_message_result_head) - 1;
+  memcpy(cursor, result, result_len);
+  cursor += result_len;
+  memcpy(cursor, "}", 2);
+  return data;
+}
+
+static const char *_aos_jrpc_message_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+static const char *_aos_jrpc_message_string(const char *p, const char *end) {
+  // Opening quote included, returns the position past the closing one
+  for (p++; p < end; p++) {
+    if (*p == '"') {
+      return p + 1;
+    }
+    if ((unsigned char)*p < 0x20) {
+      return NULL;
+    }
+    if (*p != '\\') {
+      continue;
+    }
+    if (++p == end) {
+      return NULL;
+    }
+    if (*p == 'u') {
+      for (size_t i = 0; i < 4; i++) {
+        if (++p == end || !isxdigit((unsigned char)*p)) {
+          return NULL;
+        }
+      }
+    } else if (!strchr("\"\\/bfnrt", *p)) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+static const char *_aos_jrpc_message_key(const char *p, const char *end) {
+  // Member name and separator, returns the position of the value
+  p = _aos_jrpc_message_ws(p, end);
+  if (p == end || *p != '"') {
+    return NULL;
+  }
+  p = _aos_jrpc_message_ws(_aos_jrpc_message_string(p, end), end);
+  if (!p || p == end || *p != ':') {
+    return NULL;
+  }
+  return p + 1;
+}
+
+static const char *_aos_jrpc_message_digits(const char *p, const char *end) {
+  // At least one digit
+  const char *start = p;
+  while (p < end && isdigit((unsigned char)*p)) {
+    p++;
+  }
+  return p == start ? NULL : p;
+}
+
+static const char *_aos_jrpc_message_scalar(const char *p, const char *end) {
+  static const char *literals[] = {"true", "false", "null"};
+  for (size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+    size_t len = strlen(literals[i]);
+    if ((size_t)(end - p) >= len && !memcmp(p, literals[i], len)) {
+      return p + len;
+    }
+  }
+  if (*p == '"') {
+    return _aos_jrpc_message_string(p, end);
+  }
+
+  // Number, no leading zeros
+  if (*p == '-') {
+    p++;
+  }
+  if (p < end && *p == '0') {
+    p++;
+  } else {
+    p = _aos_jrpc_message_digits(p, end);
+  }
+  if (p && p < end && *p == '.') {
+    p = _aos_jrpc_message_digits(p + 1, end);
+  }
+  if (p && p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    p = _aos_jrpc_message_digits(p, end);
+  }
+  return p;
+}
+
+static size_t _aos_jrpc_message_itoa(long long value, char *buf) {
+  // Digits are produced backwards, then moved to the front
+  char digits[20];
+  size_t count = 0;
+  unsigned long long magnitude =
+      value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  size_t len = 0;
+  if (value < 0) {
+    buf[len++] = '-';
+  }
+  while (count) {
+    buf[len++] = digits[--count];
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+static bool _aos_jrpc_message_isplain(const char *str) {
+  // Printable ASCII, nothing to escape
+  for (; *str; str++) {
+    if (*str < 0x20 || *str > 0x7e || *str == '"' || *str == '\\') {
+      return false;
+    }
+  }
+  return true;
+}
+
 cJSON *aos_jrpc_message_result(cJSON *id, cJSON *result) {
   cJSON *message = cJSON_CreateObject();
   cJSON *id_dup = cJSON_Duplicate(id, true);
@@ -101,3 +514,86 @@ cJSON *aos_jrpc_message_request(cJSON *id, const char *method, cJSON *params) {
   }
   return message;
 }
+
+bool aos_jrpc_message_scanner_init(aos_jrpc_message_scanner_t *scanner,
+                                   size_t maxlen) {
+  *scanner = (aos_jrpc_message_scanner_t){.maxlen = maxlen};
+  scanner->buf = malloc(maxlen + 1);
+  return scanner->buf;
+}
+
+void aos_jrpc_message_scanner_deinit(aos_jrpc_message_scanner_t *scanner) {
+  free(scanner->buf);
+  scanner->buf = NULL;
+}
+
+aos_jrpc_message_scan_t
+aos_jrpc_message_scan(aos_jrpc_message_scanner_t *scanner, const char *data,
+                      size_t len, size_t *consumed) {
+  // Start over after a complete message
+  if (scanner->done) {
+    scanner->len = 0;
+    scanner->overflow = false;
+    scanner->done = false;
+  }
+
+  size_t i = 0;
+  for (; i < len && !scanner->done; i++) {
+    char c = data[i];
+    if (scanner->string) {
+      if (scanner->escape) {
+        scanner->escape = false;
+      } else if (c == '\\') {
+        scanner->escape = true;
+      } else if (c == '"') {
+        // Top-level strings end at their closing quote
+        scanner->string = false;
+        scanner->done = !scanner->depth && !scanner->bare;
+      }
+    } else if (scanner->bare) {
+      // Leave the delimiter to the next message
+      if (isspace((unsigned char)c) || c == '{' || c == '[') {
+        scanner->bare = false;
+        scanner->done = true;
+        break;
+      }
+      scanner->string = c == '"';
+    } else if (!scanner->depth) {
+      // Between messages
+      if (isspace((unsigned char)c)) {
+        continue;
+      }
+      if (c == '{' || c == '[') {
+        scanner->depth = 1;
+      } else if (c == '"') {
+        scanner->string = true;
+      } else {
+        scanner->bare = true;
+      }
+    } else if (c == '"') {
+      scanner->string = true;
+    } else if (c == '{' || c == '[') {
+      scanner->depth++;
+    } else if (c == '}' || c == ']') {
+      scanner->depth--;
+      scanner->done = !scanner->depth;
+    }
+
+    // Keep the message while it fits, skip it to its end otherwise
+    if (scanner->len < scanner->maxlen) {
+      scanner->buf[scanner->len++] = c;
+    } else {
+      scanner->overflow = true;
+    }
+  }
+  *consumed = i;
+
+  if (!scanner->done) {
+    return AOS_JRPC_MESSAGE_SCAN_PARTIAL;
+  }
+  if (scanner->overflow) {
+    return AOS_JRPC_MESSAGE_SCAN_OVERFLOW;
+  }
+  scanner->buf[scanner->len] = '\0';
+  return AOS_JRPC_MESSAGE_SCAN_COMPLETE;
+}
@@ -42,6 +42,9 @@
 
 static const char *_tag = "AOS JSON-RPC peer";
 
+static unsigned int _aos_jrpc_peer_error_output(aos_jrpc_peer_t *peer,
+                                                int code, const char *msg);
+
 aos_jrpc_peer_t *aos_jrpc_peer_alloc(aos_jrpc_peer_config_t *config) {
   aos_jrpc_peer_t *peer = NULL;
   aos_jrpc_server_t *server = NULL;
@@ -65,6 +68,7 @@ aos_jrpc_peer_t *aos_jrpc_peer_alloc(aos_jrpc_peer_config_t *config) {
       .maxinputlen = config->maxinputlen ? config->maxinputlen
                                          : CONFIG_AOS_JRPC_PEER_MAXINPUTLEN,
       .parallel = config->parallel,
+      .deadlinefield = config->deadlinefield,
       .on_error = config->on_error,
       .on_output = config->on_output};
 
@@ -72,11 +76,13 @@ aos_jrpc_peer_t *aos_jrpc_peer_alloc(aos_jrpc_peer_config_t *config) {
   peer = calloc(1, sizeof(aos_jrpc_peer_t));
   aos_jrpc_server_config_t server_config = {
       .maxrequests = complete_config.maxserverrequests,
-      .parallel = complete_config.parallel};
+      .parallel = complete_config.parallel,
+      .deadlinefield = complete_config.deadlinefield};
   server = aos_jrpc_server_alloc(&server_config);
   aos_jrpc_client_config_t client_config = {
       .on_output = complete_config.on_output,
-      .maxrequests = complete_config.maxclientrequests};
+      .maxrequests = complete_config.maxclientrequests,
+      .deadlinefield = complete_config.deadlinefield};
   client = aos_jrpc_client_alloc(&client_config);
   if (!peer || !server || !client) {
     goto aos_jrpc_peer_alloc_err;
@@ -100,37 +106,71 @@ unsigned int aos_jrpc_peer_free(aos_jrpc_peer_t *peer) {
     return ret;
   }
   aos_jrpc_server_free(peer->server);
+  aos_jrpc_message_scanner_deinit(&peer->scanner);
   free(peer);
   return 0;
 }
 
 unsigned int aos_jrpc_peer_read(aos_jrpc_peer_t *peer, const char *data) {
-  cJSON *error = NULL;
-  char *error_str = NULL;
-  if (strlen(data) > peer->config.maxinputlen) {
-    error = aos_jrpc_message_error(NULL, -32000, "Server error");
-    goto aos_jrpc_peer_read_err;
+  // Stop counting past the limit
+  return aos_jrpc_peer_read_len(peer, data,
+                                strnlen(data, peer->config.maxinputlen + 1));
+}
+
+unsigned int aos_jrpc_peer_read_len(aos_jrpc_peer_t *peer, const char *data,
+                                    size_t len) {
+  if (len > peer->config.maxinputlen) {
+    return _aos_jrpc_peer_error_output(peer, -32000, "Server error");
   }
 
-  cJSON *json = cJSON_Parse(data);
+  cJSON *json = cJSON_ParseWithLength(data, len);
   if (!json) {
-    error = aos_jrpc_message_error(NULL, -32700, "Parse error");
+    return _aos_jrpc_peer_error_output(peer, -32700, "Parse error");
   }
 
   unsigned int ret = aos_jrpc_peer_read_json(peer, json);
   cJSON_Delete(json);
   return ret;
+}
+
+unsigned int aos_jrpc_peer_feed(aos_jrpc_peer_t *peer, const char *data,
+                                size_t len) {
+  if (!peer->scanner.buf &&
+      !aos_jrpc_message_scanner_init(&peer->scanner,
+                                     peer->config.maxinputlen)) {
+    return 1;
+  }
+
+  unsigned int ret = 0;
+  while (len) {
+    size_t consumed = 0;
+    aos_jrpc_message_scan_t scan =
+        aos_jrpc_message_scan(&peer->scanner, data, len, &consumed);
+    data += consumed;
+    len -= consumed;
+
+    unsigned int read_ret = 0;
+    if (scan == AOS_JRPC_MESSAGE_SCAN_COMPLETE) {
+      read_ret = aos_jrpc_peer_read_len(peer, peer->scanner.buf,
+                                        peer->scanner.len);
+    } else if (scan == AOS_JRPC_MESSAGE_SCAN_OVERFLOW) {
+      read_ret = _aos_jrpc_peer_error_output(peer, -32000, "Server error");
+    }
+    if (read_ret) {
+      ret = read_ret;
+    }
+  }
+  return ret;
+}
 
-aos_jrpc_peer_read_err:
-  error_str = cJSON_PrintUnformatted(error);
-  if (!error || !error_str) {
-    free(error_str);
-    cJSON_Delete(error);
+static unsigned int _aos_jrpc_peer_error_output(aos_jrpc_peer_t *peer,
+                                                int code, const char *msg) {
+  char *error_str = aos_jrpc_message_error_print(NULL, code, msg);
+  if (!error_str) {
     return 1;
   }
   peer->config.on_output(error_str);
   free(error_str);
-  cJSON_Delete(error);
   return 0;
 }
 
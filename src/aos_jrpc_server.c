@@ -21,10 +21,18 @@
  */
 #include <aos_jrpc_message.h>
 #include <aos_jrpc_server.h>
+#include <esp_timer.h>
+#include <float.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <limits.h>
 #include <math.h>
 #include <sdkconfig.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <string.h>
 #if CONFIG_AOS_JRPC_SERVER_LOG_NONE
 #define LOG_LOCAL_LEVEL ESP_LOG_NONE
@@ -41,40 +49,383 @@
 #endif
 #include <esp_log.h>
 
-// static const char *_tag = "AOS JSON-RPC server";
+static const char *_tag = "AOS JSON-RPC server";
 
-typedef struct _aos_jrpc_server_handler_entry_t
-    _aos_jrpc_server_handler_entry_t;
-struct _aos_jrpc_server_handler_entry_t {
-  char *method;
-  aos_jrpc_server_handler_t handler;
-  _aos_jrpc_server_handler_entry_t *next;
+/**
+ * Per-method limits state. Shared by the registry copies listing the method
+ * and by the requests holding one of its concurrency slots, freed with the last
+ * reference.
+ */
+typedef struct _aos_jrpc_server_handler_limit_t {
+  atomic_uint refs;
+  atomic_size_t concurrent; // Calls in progress, if limited
+  bool bounded;             // Concurrency is limited
+  portMUX_TYPE lock;        // Guards the token bucket
+  int64_t tokens;           // Available tokens, in millionths
+  int64_t full;             // Bucket size, 0 if not rate limited
+  int64_t stamp;            // Last refill time (us)
+} _aos_jrpc_server_handler_limit_t;
+
+#define _AOS_JRPC_SERVER_HANDLER_TOKEN 1000000
+
+/**
+ * Handler registry entry. Hash and length are computed once at registration so
+ * that lookups only compare strings on a full hash match.
+ */
+typedef struct _aos_jrpc_server_handler_entry_t {
+  uint32_t hash;
+  size_t len;
+  char *method; // NULL if slot is empty
+  aos_jrpc_server_handler_config_t config;
+  _aos_jrpc_server_handler_limit_t *limit; // NULL if unlimited
+} _aos_jrpc_server_handler_entry_t;
+
+/**
+ * Handler lookup outcome
+ */
+typedef enum _aos_jrpc_server_handler_get_t {
+  _AOS_JRPC_SERVER_HANDLER_FOUND,
+  _AOS_JRPC_SERVER_HANDLER_MISSING,
+  _AOS_JRPC_SERVER_HANDLER_LIMITED,
+} _aos_jrpc_server_handler_get_t;
+
+/**
+ * Handler registry, an open-addressing hash table with linear probing.
+ * Capacity is always a power of two. Published tables are never modified:
+ * writers publish a modified copy and reclaim the old one once no reader can
+ * still be using it (read-copy-update).
+ */
+typedef struct _aos_jrpc_server_handler_table_t {
+  size_t capacity;
+  size_t count;
+  _aos_jrpc_server_handler_entry_t entries[];
+} _aos_jrpc_server_handler_table_t;
+
+#define _AOS_JRPC_SERVER_HANDLER_TABLE_MINCAPACITY 8
+
+/**
+ * Frozen handler registry, an immutable minimal perfect-hash table built with
+ * hash-and-displace. Each method hash selects a bucket, and the bucket seed
+ * selects the one slot the method can live in. Methods sharing their full hash
+ * with another one cannot be displaced apart, they follow the table and are
+ * probed linearly. Header, seeds, entries and method strings share a single
+ * allocation.
+ */
+typedef struct _aos_jrpc_server_handler_frozen_t {
+  size_t count;
+  size_t overflow; // Entries past count, sharing a hash with a table entry
+  uint32_t *seeds;
+  _aos_jrpc_server_handler_entry_t *entries;
+} _aos_jrpc_server_handler_frozen_t;
+
+/**
+ * Active request ID entry. IDs point to the copy owned by the request context,
+ * so entries can be removed by identity.
+ */
+typedef struct _aos_jrpc_server_id_entry_t {
+  uint32_t hash;
+  cJSON *id; // NULL if slot is empty
+} _aos_jrpc_server_id_entry_t;
+
+#define _AOS_JRPC_SERVER_SHUTDOWN (~(UINT_MAX >> 1))
+
+/**
+ * Task input, stamped when pushed so that client deadlines count queueing
+ */
+typedef struct _aos_jrpc_server_input_t {
+  char *data; // NULL means stop
+  int64_t arrival;
+} _aos_jrpc_server_input_t;
+
+// Handler error set by workers skipping requests whose client deadline expired
+#define _AOS_JRPC_SERVER_ERR_EXPIRED ((aos_jrpc_server_err_t)-1)
+
+/**
+ * Request arena. Parse trees are allocated in chained blocks through cJSON
+ * hooks serving the arena open on the calling task, and released at once.
+ */
+typedef struct _aos_jrpc_server_arena_block_t _aos_jrpc_server_arena_block_t;
+struct _aos_jrpc_server_arena_block_t {
+  _aos_jrpc_server_arena_block_t *next;
+  size_t size;
+  size_t used;
+  alignas(max_align_t) unsigned char data[];
+};
+
+typedef struct _aos_jrpc_server_arena_t {
+  size_t blocksize;                       // Heap if 0
+  _aos_jrpc_server_arena_block_t *blocks; // Most recent first
+} _aos_jrpc_server_arena_t;
+
+static _Thread_local _aos_jrpc_server_arena_t *_aos_jrpc_server_arena = NULL;
+static atomic_bool _aos_jrpc_server_arena_installed = false;
+
+/**
+ * Context free list. Objects are carved out of the same allocation and linked
+ * through their first bytes while free, requests for larger objects or made
+ * while the list is empty fall back to the heap. The list is released once
+ * its owner and every object handed out are done with it, so objects may
+ * outlive the server.
+ */
+typedef struct _aos_jrpc_server_freelist_t {
+  portMUX_TYPE lock;
+  size_t size; // Object size, a multiple of the maximum alignment
+  size_t capacity;
+  void *head;       // NULL if empty
+  atomic_uint refs; // Owner plus objects handed out
+  atomic_uint hits;
+  atomic_uint misses;
+  alignas(max_align_t) unsigned char objects[];
+} _aos_jrpc_server_freelist_t;
+
+/**
+ * Request state. Completion and deadline expiry race to move a running request
+ * to their own state, the loser backs off. Requests timing out while still
+ * queued for the worker pool keep their slot until a worker drops them, so
+ * that queued jobs never outnumber slots.
+ */
+typedef enum _aos_jrpc_server_request_state_t {
+  _AOS_JRPC_SERVER_REQUEST_RUNNING = 0,
+  _AOS_JRPC_SERVER_REQUEST_QUEUED,   // Waiting for a worker
+  _AOS_JRPC_SERVER_REQUEST_DONE,     // Handler resolved in time
+  _AOS_JRPC_SERVER_REQUEST_TIMEDOUT, // Timeout response sent, handler pending
+} _aos_jrpc_server_request_state_t;
+
+#define _AOS_JRPC_SERVER_IDLEN 16
+
+/**
+ * Parameter descriptors per handler, one bit each while binding
+ */
+#define _AOS_JRPC_SERVER_PARAMS_MAX 32
+
+/**
+ * Parameter types storage and range. 64-bit limits are the largest doubles
+ * that still convert. Integral types take no fractional part.
+ */
+static const struct {
+  size_t size;
+  double min;
+  double max;
+  bool integral;
+} _aos_jrpc_server_param_types[AOS_JRPC_SERVER_PARAM_TYPES] = {
+    [AOS_JRPC_SERVER_PARAM_UINT8] = {sizeof(uint8_t), 0, UINT8_MAX, true},
+    [AOS_JRPC_SERVER_PARAM_UINT16] = {sizeof(uint16_t), 0, UINT16_MAX, true},
+    [AOS_JRPC_SERVER_PARAM_UINT32] = {sizeof(uint32_t), 0, UINT32_MAX, true},
+    [AOS_JRPC_SERVER_PARAM_UINT64] = {sizeof(uint64_t), 0,
+                                      (double)(UINT64_MAX - 2047), true},
+    [AOS_JRPC_SERVER_PARAM_INT8] = {sizeof(int8_t), INT8_MIN, INT8_MAX, true},
+    [AOS_JRPC_SERVER_PARAM_INT16] = {sizeof(int16_t), INT16_MIN, INT16_MAX,
+                                     true},
+    [AOS_JRPC_SERVER_PARAM_INT32] = {sizeof(int32_t), INT32_MIN, INT32_MAX,
+                                     true},
+    [AOS_JRPC_SERVER_PARAM_INT64] = {sizeof(int64_t), INT64_MIN,
+                                     (double)(INT64_MAX - 1023), true},
+    [AOS_JRPC_SERVER_PARAM_FLOAT] = {sizeof(float), -FLT_MAX, FLT_MAX},
+    [AOS_JRPC_SERVER_PARAM_DOUBLE] = {sizeof(double), -DBL_MAX, DBL_MAX},
+    [AOS_JRPC_SERVER_PARAM_STR] = {sizeof(char *)},
+    [AOS_JRPC_SERVER_PARAM_BOOL] = {sizeof(bool)},
+    [AOS_JRPC_SERVER_PARAM_ARRAY] = {sizeof(cJSON *)},
+    [AOS_JRPC_SERVER_PARAM_OBJECT] = {sizeof(cJSON *)},
 };
 
+/**
+ * Request context. Handler, handler future and params are only set for
+ * requests handed over to the worker pool. Bound parameters live in storage,
+ * followed by the strings copied for them if they fit.
+ */
+typedef struct _aos_jrpc_server_request_handle_ctx_t {
+  aos_future_t *future; // aos_jrpc_server_call future in text mode
+  bool text;
+  bool validateraw;
+  cJSON *id;  // Points to idbuf unless the ID is too long to fit
+  cJSON idbuf;
+  char idstr[_AOS_JRPC_SERVER_IDLEN];
+  aos_jrpc_server_t *server;
+  aos_jrpc_server_handler_t handler;
+  cJSON *params;  // Owned copy freed with ctx, the request may go meanwhile
+  void *bound;    // Parameters bound by the handler descriptors, if any
+  char *strings;  // Bound strings not fitting storage, if any
+  aos_future_t *handler_future;
+  _aos_jrpc_server_handler_limit_t *limit; // Held method limits, if any
+  int64_t deadline;     // Execution deadline (us), 0 if none
+  size_t deadlineindex; // Position in the deadline heap, SIZE_MAX if not in
+  int64_t expiry;       // Client deadline (us), 0 if none
+  struct _aos_jrpc_server_request_handle_ctx_t *reapnext; // Reaper list link
+  bool reapqueued; // Timed out while queued, the worker releases the slot
+  atomic_uint state;
+  atomic_uint abandoned; // Parties done with the request once timed out
+  _aos_jrpc_server_freelist_t *freelist; // May outlive the server
+  max_align_t storage[];
+} _aos_jrpc_server_request_handle_ctx_t;
+
 struct _aos_jrpc_server_t {
   aos_jrpc_server_config_t config;
-  SemaphoreHandle_t semaphore;
-  _aos_jrpc_server_handler_entry_t *handlers;
-  uint32_t counter;
+  SemaphoreHandle_t semaphore; // Serializes handler registry writers
+  _Atomic(_aos_jrpc_server_handler_table_t *) handlers; // NULL if empty
+  _Atomic(_aos_jrpc_server_handler_frozen_t *) frozen;  // Not NULL once frozen
+  atomic_uint epoch;      // Registry grace period counter
+  atomic_uint readers[2]; // Registry readers per epoch parity
+  atomic_uint counter;    // Requests in progress
+  atomic_uint inflight; // In-flight references, shutdown flag in the top bit
+  _Atomic(aos_future_t *) shutdown; // Pending shutdown future
+  portMUX_TYPE idslock;
+  size_t idscapacity; // Power of two, at least twice maxrequests
+  _aos_jrpc_server_id_entry_t *ids; // Open-addressing table of active IDs
+  QueueHandle_t queue[AOS_JRPC_SERVER_PRIORITIES]; // Task inputs per class
+  SemaphoreHandle_t taskbell;  // Task inputs queued, NULL if no task
+  SemaphoreHandle_t taskdone;  // Given by the task when it exits
+  TaskHandle_t task;           // NULL if no task
+  QueueHandle_t pool[AOS_JRPC_SERVER_PRIORITIES]; // Pooled requests per class
+  SemaphoreHandle_t poolbell;  // Pooled requests queued, NULL if no pool
+  SemaphoreHandle_t pooldone;  // Given by each worker when it exits
+  size_t workers;              // Workers started
+  portMUX_TYPE deadlineslock;
+  size_t deadlinescount;
+  _aos_jrpc_server_request_handle_ctx_t **deadlines; // Min-heap by deadline
+  esp_timer_handle_t timer;    // Fires at the earliest deadline
+  SemaphoreHandle_t timerlock; // Serializes timer updates
+  _aos_jrpc_server_request_handle_ctx_t *reaped; // Timed out, latest first
+  bool reaperstop;               // Set under deadlineslock
+  SemaphoreHandle_t reaperbell;  // Given by the timer, NULL if no reaper
+  SemaphoreHandle_t reaperdone;  // Given by the reaper when it exits
+  TaskHandle_t reaper;           // Started along with the first timeout
+  aos_jrpc_message_scanner_t scanner; // Fed input, allocated on first use
+  _aos_jrpc_server_freelist_t *requestctxs;
+  _aos_jrpc_server_freelist_t *batchctxs; // Sized for parallel ones if enabled
 };
 
-AOS_DEFINE(aos_jrpc_server_handler, cJSON *, aos_jrpc_server_err_t)
+AOS_DEFINE(aos_jrpc_server_handler, const void *, cJSON *,
+           aos_jrpc_server_err_t, char *)
 static void aos_jrpc_server_call_cb(aos_future_t *future);
+static void _aos_jrpc_server_call_len(aos_jrpc_server_t *server,
+                                      const char *data, size_t len,
+                                      aos_future_t *future, int64_t arrival);
+static void _aos_jrpc_server_dispatch(aos_jrpc_server_t *server, cJSON *data,
+                                      aos_future_t *future, bool text,
+                                      int64_t arrival);
+static void _aos_jrpc_server_respond(aos_future_t *future, bool text,
+                                     cJSON *response);
+static void _aos_jrpc_server_respond_error(aos_future_t *future, bool text,
+                                           cJSON *id, int code,
+                                           const char *msg);
+static void _aos_jrpc_server_respond_result(aos_future_t *future, bool text,
+                                            cJSON *id, cJSON *result);
+static void _aos_jrpc_server_respond_raw(aos_future_t *future, bool text,
+                                         cJSON *id, char *raw);
 static void _aos_jrpc_server_request_handle(aos_jrpc_server_t *server,
                                             cJSON *request,
-                                            aos_future_t *future);
+                                            aos_future_t *future, bool text,
+                                            int64_t arrival);
 static void _aos_jrpc_server_request_handle_cb(aos_future_t *future);
+static cJSON *
+_aos_jrpc_server_request_id_copy(_aos_jrpc_server_request_handle_ctx_t *ctx,
+                                 cJSON *id);
+static void
+_aos_jrpc_server_request_free(_aos_jrpc_server_request_handle_ctx_t *ctx);
+static void
+_aos_jrpc_server_request_abandon(_aos_jrpc_server_request_handle_ctx_t *ctx);
 static void _aos_jrpc_server_batch_handle_sequential(aos_jrpc_server_t *server,
                                                      cJSON *request,
-                                                     aos_future_t *future);
+                                                     aos_future_t *future,
+                                                     int64_t arrival);
 static void _aos_jrpc_server_batch_handle_sequential_cb(aos_future_t *future);
 static void _aos_jrpc_server_batch_handle_parallel(aos_jrpc_server_t *server,
                                                    cJSON *request,
-                                                   aos_future_t *future);
+                                                   aos_future_t *future,
+                                                   int64_t arrival);
 static void _aos_jrpc_server_batch_handle_parallel_cb(aos_future_t *future);
-static aos_jrpc_server_handler_t
-_aos_jrpc_server_handler_get(aos_jrpc_server_t *server, const char *method);
+static size_t _aos_jrpc_server_batch_ctx_size(bool parallel, size_t items);
+static _aos_jrpc_server_freelist_t *
+_aos_jrpc_server_freelist_alloc(size_t size, size_t capacity);
+static void _aos_jrpc_server_freelist_release(_aos_jrpc_server_freelist_t *fl);
+static void *_aos_jrpc_server_freelist_get(_aos_jrpc_server_freelist_t *fl,
+                                           size_t size);
+static void _aos_jrpc_server_freelist_put(_aos_jrpc_server_freelist_t *fl,
+                                          void *obj);
+static _aos_jrpc_server_handler_get_t
+_aos_jrpc_server_handler_get(aos_jrpc_server_t *server, const char *method,
+                             aos_jrpc_server_handler_config_t *config,
+                             _aos_jrpc_server_handler_limit_t **limit);
+static uint32_t _aos_jrpc_server_hash(const char *str, size_t *len);
+static uint32_t _aos_jrpc_server_hash_mix(uint32_t hash, uint32_t seed);
+static _aos_jrpc_server_handler_entry_t *
+_aos_jrpc_server_handler_table_find(_aos_jrpc_server_handler_table_t *table,
+                                    uint32_t hash, size_t len,
+                                    const char *method);
+static _aos_jrpc_server_handler_table_t *
+_aos_jrpc_server_handler_table_copy(_aos_jrpc_server_handler_table_t *table,
+                                    size_t capacity,
+                                    _aos_jrpc_server_handler_entry_t *skip);
+static unsigned int _aos_jrpc_server_read_lock(aos_jrpc_server_t *server);
+static void _aos_jrpc_server_read_unlock(aos_jrpc_server_t *server,
+                                         unsigned int epoch);
+static void _aos_jrpc_server_synchronize(aos_jrpc_server_t *server);
+static bool _aos_jrpc_server_slot_acquire(aos_jrpc_server_t *server,
+                                          aos_jrpc_server_priority_t priority);
+static void _aos_jrpc_server_slot_release(aos_jrpc_server_t *server);
+static _aos_jrpc_server_handler_limit_t *
+_aos_jrpc_server_handler_limit_alloc(
+    const aos_jrpc_server_handler_config_t *config);
+static bool
+_aos_jrpc_server_handler_limit_acquire(_aos_jrpc_server_handler_entry_t *entry,
+                                       _aos_jrpc_server_handler_limit_t **held);
+static void
+_aos_jrpc_server_handler_limit_refund(_aos_jrpc_server_handler_limit_t *limit);
+static void
+_aos_jrpc_server_handler_limit_release(_aos_jrpc_server_handler_limit_t *limit);
+static void
+_aos_jrpc_server_handler_limit_unref(_aos_jrpc_server_handler_limit_t *limit);
+static void _aos_jrpc_server_deadline_add(
+    aos_jrpc_server_t *server, _aos_jrpc_server_request_handle_ctx_t *ctx);
+static void _aos_jrpc_server_deadline_remove(
+    aos_jrpc_server_t *server, _aos_jrpc_server_request_handle_ctx_t *ctx);
+static void _aos_jrpc_server_deadline_arm(aos_jrpc_server_t *server);
+static void _aos_jrpc_server_deadline_cb(void *arg);
+static void _aos_jrpc_server_deadline_sift(aos_jrpc_server_t *server,
+                                           size_t index);
+static void *_aos_jrpc_server_arena_malloc(size_t size);
+static void _aos_jrpc_server_arena_free(void *ptr);
+static cJSON *_aos_jrpc_server_arena_parse(_aos_jrpc_server_arena_t *arena,
+                                           const char *data, size_t len);
+static void _aos_jrpc_server_arena_delete(_aos_jrpc_server_arena_t *arena,
+                                          cJSON *json);
+static bool _aos_jrpc_server_inflight_enter(aos_jrpc_server_t *server);
+static void _aos_jrpc_server_inflight_hold(aos_jrpc_server_t *server);
+static void _aos_jrpc_server_inflight_release(aos_jrpc_server_t *server);
+static bool _aos_jrpc_server_id_track(aos_jrpc_server_t *server, cJSON *id);
+static void _aos_jrpc_server_id_untrack(aos_jrpc_server_t *server, cJSON *id);
 static bool _aos_jrpc_server_isvalid(cJSON *request);
+static bool
+_aos_jrpc_server_params_check(const aos_jrpc_server_handler_config_t *config);
+static bool
+_aos_jrpc_server_params_bind(const aos_jrpc_server_handler_config_t *config,
+                             cJSON *params, void *bound);
+static bool _aos_jrpc_server_param_bind(const aos_jrpc_server_param_t *param,
+                                        cJSON *json, void *bound);
+static bool
+_aos_jrpc_server_params_detach(const aos_jrpc_server_handler_config_t *config,
+                               _aos_jrpc_server_request_handle_ctx_t *ctx,
+                               size_t room);
+static void _aos_jrpc_server_tasks_stop(aos_jrpc_server_t *server);
+static bool _aos_jrpc_server_lanes_create(QueueHandle_t *lanes,
+                                          SemaphoreHandle_t *bell, size_t len,
+                                          size_t itemsize);
+static void _aos_jrpc_server_lanes_delete(QueueHandle_t *lanes,
+                                          SemaphoreHandle_t bell);
+static bool _aos_jrpc_server_lanes_send(QueueHandle_t *lanes,
+                                        SemaphoreHandle_t bell,
+                                        const void *item,
+                                        aos_jrpc_server_priority_t priority,
+                                        TickType_t timeout);
+static void _aos_jrpc_server_lanes_receive(QueueHandle_t *lanes,
+                                           SemaphoreHandle_t bell, void *item);
+static void _aos_jrpc_server_worker(void *arg);
+static void _aos_jrpc_server_task(void *arg);
+static bool _aos_jrpc_server_reaper_start(aos_jrpc_server_t *server);
+static void _aos_jrpc_server_reaper_stop(aos_jrpc_server_t *server);
+static void _aos_jrpc_server_reaper_delete(aos_jrpc_server_t *server);
+static void _aos_jrpc_server_reaper(void *arg);
+static void _aos_jrpc_server_task_cb(aos_future_t *future);
 
 aos_jrpc_server_t *aos_jrpc_server_alloc(aos_jrpc_server_config_t *config) {
   // Build config
@@ -83,12 +434,75 @@ aos_jrpc_server_t *aos_jrpc_server_alloc(aos_jrpc_server_config_t *config) {
                                          : CONFIG_AOS_JRPC_SERVER_MAXREQUESTS,
       .maxinputlen = config->maxinputlen ? config->maxinputlen
                                          : CONFIG_AOS_JRPC_SERVER_MAXINPUTLEN,
-      .parallel = config->parallel};
+      .timeout = config->timeout,
+      .reserved = config->reserved,
+      .priorityfield = config->priorityfield,
+      .deadlinefield = config->deadlinefield,
+      .parallel = config->parallel,
+      .window = config->window,
+      .shutdowncode = config->shutdowncode ? config->shutdowncode : -32003,
+      .arena = config->arena,
+      .batches = config->batches ? config->batches
+                                 : CONFIG_AOS_JRPC_SERVER_BATCHES,
+      .batchitems = config->batchitems ? config->batchitems
+                                       : CONFIG_AOS_JRPC_SERVER_BATCHITEMS,
+      .paramspace = config->paramspace ? config->paramspace
+                                       : CONFIG_AOS_JRPC_SERVER_PARAMSPACE,
+      .task = {
+          .queuelen = config->task.queuelen,
+          .stacksize = config->task.stacksize
+                           ? config->task.stacksize
+                           : CONFIG_AOS_JRPC_SERVER_TASK_STACKSIZE,
+          .priority = config->task.priority
+                          ? config->task.priority
+                          : CONFIG_AOS_JRPC_SERVER_TASK_PRIORITY,
+          .core = config->task.core,
+          .on_output = config->task.on_output,
+          .ctx = config->task.ctx,
+      },
+      .pool = {
+          .workers = config->pool.workers,
+          .stacksize = config->pool.stacksize
+                           ? config->pool.stacksize
+                           : CONFIG_AOS_JRPC_SERVER_POOL_STACKSIZE,
+          .priority = config->pool.priority
+                          ? config->pool.priority
+                          : CONFIG_AOS_JRPC_SERVER_POOL_PRIORITY,
+      },
+      .reaper = {
+          .stacksize = config->reaper.stacksize
+                           ? config->reaper.stacksize
+                           : CONFIG_AOS_JRPC_SERVER_REAPER_STACKSIZE,
+          .priority = config->reaper.priority
+                          ? config->reaper.priority
+                          : CONFIG_AOS_JRPC_SERVER_REAPER_PRIORITY,
+      }};
+  if (complete_config.task.queuelen && !complete_config.task.on_output) {
+    ESP_LOGE(_tag, "Task variant requires an output callback");
+    return NULL;
+  }
+  if (complete_config.reserved >= complete_config.maxrequests) {
+    ESP_LOGE(_tag, "Reserved slots must be fewer than maximum requests");
+    return NULL;
+  }
+  if (complete_config.arena &&
+      !atomic_load(&_aos_jrpc_server_arena_installed)) {
+    ESP_LOGW(_tag, "Arena hooks not installed, parsing requests on the heap");
+  }
+
+  // Every active ID holds a request slot, keep the ID table at most half full
+  size_t idscapacity = 8;
+  while (idscapacity < 2 * complete_config.maxrequests) {
+    idscapacity *= 2;
+  }
 
   aos_jrpc_server_t *server = calloc(1, sizeof(aos_jrpc_server_t));
   SemaphoreHandle_t semaphore = xSemaphoreCreateRecursiveMutex();
-  if (!server || !semaphore) {
+  _aos_jrpc_server_id_entry_t *ids =
+      calloc(idscapacity, sizeof(_aos_jrpc_server_id_entry_t));
+  if (!server || !semaphore || !ids) {
     free(server);
+    free(ids);
     if (semaphore) {
       vSemaphoreDelete(semaphore);
     }
@@ -96,62 +510,219 @@ aos_jrpc_server_t *aos_jrpc_server_alloc(aos_jrpc_server_config_t *config) {
   }
   server->config = complete_config;
   server->semaphore = semaphore;
+  portMUX_INITIALIZE(&server->idslock);
+  server->idscapacity = idscapacity;
+  server->ids = ids;
+
+  // Context caches, every request context holds a request slot
+  server->requestctxs = _aos_jrpc_server_freelist_alloc(
+      sizeof(_aos_jrpc_server_request_handle_ctx_t) +
+          complete_config.paramspace,
+      complete_config.maxrequests);
+  server->batchctxs = _aos_jrpc_server_freelist_alloc(
+      _aos_jrpc_server_batch_ctx_size(complete_config.parallel,
+                                      complete_config.batchitems),
+      complete_config.batches);
+  if (!server->requestctxs || !server->batchctxs) {
+    goto aos_jrpc_server_alloc_err;
+  }
+
+  // Deadline heap and its timer, every entry holds a request slot
+  portMUX_INITIALIZE(&server->deadlineslock);
+  server->deadlines = calloc(complete_config.maxrequests,
+                             sizeof(_aos_jrpc_server_request_handle_ctx_t *));
+  server->timerlock = xSemaphoreCreateMutex();
+  esp_timer_create_args_t timer_config = {
+      .callback = _aos_jrpc_server_deadline_cb, .arg = server};
+  if (!server->deadlines || !server->timerlock ||
+      ESP_OK != esp_timer_create(&timer_config, &server->timer)) {
+    goto aos_jrpc_server_alloc_err;
+  }
+
+  // Timed out requests are answered by the reaper, started along with the
+  // first timeout
+  if (complete_config.timeout && !_aos_jrpc_server_reaper_start(server)) {
+    goto aos_jrpc_server_alloc_err;
+  }
+
+  // Start worker pool if requested, pinning workers round-robin across cores.
+  // Every pooled job holds a request slot, so the pool queues never fill up.
+  if (complete_config.pool.workers) {
+    server->pooldone =
+        xSemaphoreCreateCounting(complete_config.pool.workers, 0);
+    if (!_aos_jrpc_server_lanes_create(
+            server->pool, &server->poolbell, complete_config.maxrequests,
+            sizeof(_aos_jrpc_server_request_handle_ctx_t *)) ||
+        !server->pooldone) {
+      goto aos_jrpc_server_alloc_err;
+    }
+    for (; server->workers < complete_config.pool.workers; server->workers++) {
+      if (xTaskCreatePinnedToCore(_aos_jrpc_server_worker, "aos_jrpc_worker",
+                                  complete_config.pool.stacksize, server,
+                                  complete_config.pool.priority, NULL,
+                                  server->workers % portNUM_PROCESSORS) !=
+          pdPASS) {
+        goto aos_jrpc_server_alloc_err;
+      }
+    }
+  }
+
+  // Start task if requested
+  if (complete_config.task.queuelen) {
+    server->taskdone = xSemaphoreCreateBinary();
+    if (!_aos_jrpc_server_lanes_create(server->queue, &server->taskbell,
+                                       complete_config.task.queuelen,
+                                       sizeof(_aos_jrpc_server_input_t)) ||
+        !server->taskdone ||
+        xTaskCreatePinnedToCore(_aos_jrpc_server_task, "aos_jrpc_server",
+                                complete_config.task.stacksize, server,
+                                complete_config.task.priority, &server->task,
+                                complete_config.task.core < 0
+                                    ? tskNO_AFFINITY
+                                    : complete_config.task.core) != pdPASS) {
+      server->task = NULL;
+      goto aos_jrpc_server_alloc_err;
+    }
+  }
   return server;
+
+aos_jrpc_server_alloc_err:
+  _aos_jrpc_server_tasks_stop(server);
+  _aos_jrpc_server_reaper_stop(server);
+  esp_timer_delete(server->timer); // Passing NULL is ok
+  _aos_jrpc_server_reaper_delete(server);
+  if (server->timerlock) {
+    vSemaphoreDelete(server->timerlock);
+  }
+  free(server->deadlines);
+  if (server->requestctxs) {
+    _aos_jrpc_server_freelist_release(server->requestctxs);
+  }
+  if (server->batchctxs) {
+    _aos_jrpc_server_freelist_release(server->batchctxs);
+  }
+  vSemaphoreDelete(semaphore);
+  free(ids);
+  free(server);
+  return NULL;
+}
+
+AOS_DEFINE(aos_jrpc_server_shutdown, unsigned int)
+void aos_jrpc_server_shutdown(aos_jrpc_server_t *server,
+                              aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_shutdown) *args = aos_args_get(future);
+
+  // Only one shutdown can be pending
+  aos_future_t *pending = NULL;
+  if (!atomic_compare_exchange_strong(&server->shutdown, &pending, future)) {
+    args->out_err = 1;
+    aos_resolve(future);
+    return;
+  }
+
+  // Stop admitting requests, resolve now if nothing is in flight. Otherwise
+  // the last release will.
+  unsigned int inflight =
+      atomic_fetch_or(&server->inflight, _AOS_JRPC_SERVER_SHUTDOWN);
+  if (!(inflight & ~_AOS_JRPC_SERVER_SHUTDOWN)) {
+    future = atomic_exchange(&server->shutdown, NULL);
+    if (future) {
+      aos_resolve(future);
+    }
+  }
 }
 
 void aos_jrpc_server_free(aos_jrpc_server_t *server) {
+  _aos_jrpc_server_tasks_stop(server);
   // Unset all handlers
-  _aos_jrpc_server_handler_entry_t **entry = &server->handlers;
-  while (*entry) {
-    _aos_jrpc_server_handler_entry_t *entry_next = (*entry)->next;
-    free((*entry)->method);
-    free((*entry));
-    *entry = entry_next;
+  _aos_jrpc_server_handler_table_t *table = atomic_load(&server->handlers);
+  for (size_t i = 0; table && i < table->capacity; i++) {
+    _aos_jrpc_server_handler_limit_unref(table->entries[i].limit);
+    free(table->entries[i].method);
   }
+  free(table);
+  _aos_jrpc_server_handler_frozen_t *frozen = atomic_load(&server->frozen);
+  for (size_t i = 0; frozen && i < frozen->count + frozen->overflow; i++) {
+    _aos_jrpc_server_handler_limit_unref(frozen->entries[i].limit);
+  }
+  free(frozen);
+  free(server->ids);
+  _aos_jrpc_server_reaper_stop(server); // It may still be rearming the timer
+  esp_timer_stop(server->timer);
+  esp_timer_delete(server->timer);
+  _aos_jrpc_server_reaper_delete(server); // The timer cannot ring it anymore
+  vSemaphoreDelete(server->timerlock);
+  free(server->deadlines);
+  aos_jrpc_message_scanner_deinit(&server->scanner);
+  _aos_jrpc_server_freelist_release(server->requestctxs);
+  _aos_jrpc_server_freelist_release(server->batchctxs);
   // Delete server
   vSemaphoreDelete(server->semaphore);
   free(server);
 }
 
+void aos_jrpc_server_stats_get(aos_jrpc_server_t *server,
+                               aos_jrpc_server_stats_t *stats) {
+  stats->requesthits = atomic_load(&server->requestctxs->hits);
+  stats->requestmisses = atomic_load(&server->requestctxs->misses);
+  stats->batchhits = atomic_load(&server->batchctxs->hits);
+  stats->batchmisses = atomic_load(&server->batchctxs->misses);
+}
+
 AOS_DEFINE(aos_jrpc_server_call, char *, unsigned int)
 void aos_jrpc_server_call(aos_jrpc_server_t *server, const char *data,
                           aos_future_t *future) {
-  AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
-  cJSON *err_response = NULL;
+  // Stop counting past the limit
+  aos_jrpc_server_call_len(
+      server, data, strnlen(data, server->config.maxinputlen + 1), future);
+}
+
+void aos_jrpc_server_call_len(aos_jrpc_server_t *server, const char *data,
+                              size_t len, aos_future_t *future) {
+  _aos_jrpc_server_call_len(server, data, len, future, esp_timer_get_time());
+}
+
+static void _aos_jrpc_server_call_len(aos_jrpc_server_t *server,
+                                      const char *data, size_t len,
+                                      aos_future_t *future, int64_t arrival) {
   cJSON *request = NULL;
+  _aos_jrpc_server_arena_t arena = {.blocksize = server->config.arena};
 
-  if (strlen(data) > server->config.maxinputlen) {
-    err_response = aos_jrpc_message_error(
-        NULL, -32000, "Server error"); // NOTE: -32000 means input too long
+  if (len > server->config.maxinputlen) {
+    _aos_jrpc_server_respond_error(
+        future, true, NULL, -32000,
+        "Server error"); // NOTE: -32000 means input too long
     goto aos_jrpc_server_call_err;
   }
 
-  request = cJSON_Parse(data);
+  request = _aos_jrpc_server_arena_parse(&arena, data, len);
   if (!request) {
-    err_response = aos_jrpc_message_error(NULL, -32700, "Parse error");
+    _aos_jrpc_server_respond_error(future, true, NULL, -32700, "Parse error");
     goto aos_jrpc_server_call_err;
   }
 
+  // Only batches go through cJSON responses, printed once complete
+  if (!cJSON_IsArray(request)) {
+    _aos_jrpc_server_dispatch(server, request, future, true, arrival);
+    _aos_jrpc_server_arena_delete(&arena, request);
+    return;
+  }
+
   aos_future_config_t config = {.cb = aos_jrpc_server_call_cb, .ctx = future};
   aos_future_t *json_future =
       AOS_FUTURE_ALLOC_T(aos_jrpc_server_call_json)(&config, NULL, 0);
   if (!json_future) {
-    err_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
+    _aos_jrpc_server_respond_error(future, true, NULL, -32603,
+                                   "Internal error");
     goto aos_jrpc_server_call_err;
   }
-  aos_jrpc_server_call_json(server, request, json_future);
-  cJSON_Delete(request);
+  _aos_jrpc_server_dispatch(server, request, json_future, false, arrival);
+  _aos_jrpc_server_arena_delete(&arena, request);
   return;
 
 aos_jrpc_server_call_err:
-  cJSON_Delete(request);
-  args->out_data = cJSON_PrintUnformatted(err_response);
-  cJSON_Delete(err_response);
-  if (!args->out_data) {
-    args->out_err = 1;
-  }
+  _aos_jrpc_server_arena_delete(&arena, request);
   aos_resolve(future);
-  return;
 }
 
 static void aos_jrpc_server_call_cb(aos_future_t *future) {
@@ -180,95 +751,518 @@ aos_jrpc_server_call_cb_end:
   aos_resolve(call_future);
 }
 
+unsigned int aos_jrpc_server_push(aos_jrpc_server_t *server, char *data) {
+  return aos_jrpc_server_push_priority(server, data,
+                                       AOS_JRPC_SERVER_PRIORITY_NORMAL);
+}
+
+unsigned int
+aos_jrpc_server_push_priority(aos_jrpc_server_t *server, char *data,
+                              aos_jrpc_server_priority_t priority) {
+  // NULL is reserved to stop the task
+  _aos_jrpc_server_input_t input = {.data = data,
+                                    .arrival = esp_timer_get_time()};
+  if (!data || !server->taskbell || priority >= AOS_JRPC_SERVER_PRIORITIES ||
+      !_aos_jrpc_server_lanes_send(server->queue, server->taskbell, &input,
+                                   priority, 0)) {
+    return 1;
+  }
+  return 0;
+}
+
+unsigned int aos_jrpc_server_feed(aos_jrpc_server_t *server, const char *data,
+                                  size_t len) {
+  if (!server->config.task.on_output ||
+      (!server->scanner.buf &&
+       !aos_jrpc_message_scanner_init(&server->scanner,
+                                      server->config.maxinputlen))) {
+    return 1;
+  }
+
+  // Chunks are parsed right away, messages completed by this one arrive now
+  int64_t arrival = esp_timer_get_time();
+  unsigned int err = 0;
+  while (len) {
+    size_t consumed = 0;
+    aos_jrpc_message_scan_t scan =
+        aos_jrpc_message_scan(&server->scanner, data, len, &consumed);
+    data += consumed;
+    len -= consumed;
+
+    if (scan == AOS_JRPC_MESSAGE_SCAN_COMPLETE) {
+      // Requests don't reference input after parsing, the buffer can be reused
+      aos_future_config_t config = {.cb = _aos_jrpc_server_task_cb,
+                                    .ctx = server};
+      aos_future_t *future =
+          AOS_FUTURE_ALLOC_T(aos_jrpc_server_call)(&config, NULL, 0);
+      if (!future) {
+        ESP_LOGE(_tag, "Could not allocate call future, input dropped");
+        err = 1;
+        continue;
+      }
+      _aos_jrpc_server_call_len(server, server->scanner.buf,
+                                server->scanner.len, future, arrival);
+    } else if (scan == AOS_JRPC_MESSAGE_SCAN_OVERFLOW) {
+      char *response_data = aos_jrpc_message_error_print(
+          NULL, -32000, "Server error"); // NOTE: -32000 means input too long
+      if (!response_data) {
+        err = 1;
+        continue;
+      }
+      server->config.task.on_output(response_data, server->config.task.ctx);
+    }
+  }
+  return err;
+}
+
+/**
+ * Task variant and worker pool
+ */
+static void _aos_jrpc_server_tasks_stop(aos_jrpc_server_t *server) {
+  // Stop task first as it feeds the pool. Tasks process queued items before
+  // getting to the NULL stop item.
+  if (server->task) {
+    _aos_jrpc_server_input_t stop = {0};
+    _aos_jrpc_server_lanes_send(server->queue, server->taskbell, &stop,
+                                AOS_JRPC_SERVER_PRIORITY_NORMAL,
+                                portMAX_DELAY);
+    xSemaphoreTake(server->taskdone, portMAX_DELAY);
+  }
+  _aos_jrpc_server_lanes_delete(server->queue, server->taskbell);
+  if (server->taskdone) {
+    vSemaphoreDelete(server->taskdone);
+  }
+
+  for (size_t i = 0; i < server->workers; i++) {
+    _aos_jrpc_server_request_handle_ctx_t *stop = NULL;
+    _aos_jrpc_server_lanes_send(server->pool, server->poolbell, &stop,
+                                AOS_JRPC_SERVER_PRIORITY_NORMAL,
+                                portMAX_DELAY);
+  }
+  for (size_t i = 0; i < server->workers; i++) {
+    xSemaphoreTake(server->pooldone, portMAX_DELAY);
+  }
+  _aos_jrpc_server_lanes_delete(server->pool, server->poolbell);
+  if (server->pooldone) {
+    vSemaphoreDelete(server->pooldone);
+  }
+}
+
+static void _aos_jrpc_server_worker(void *arg) {
+  aos_jrpc_server_t *server = arg;
+  _aos_jrpc_server_request_handle_ctx_t *ctx = NULL;
+
+  // A NULL job means stop
+  while (true) {
+    _aos_jrpc_server_lanes_receive(server->pool, server->poolbell, &ctx);
+    if (!ctx) {
+      break;
+    }
+
+    // Drop requests that timed out while queued, along with their slot
+    unsigned int state = _AOS_JRPC_SERVER_REQUEST_QUEUED;
+    if (!atomic_compare_exchange_strong(&ctx->state, &state,
+                                        _AOS_JRPC_SERVER_REQUEST_RUNNING)) {
+      aos_future_free(ctx->handler_future);
+      _aos_jrpc_server_slot_release(server);
+      _aos_jrpc_server_request_abandon(ctx);
+      continue;
+    }
+    if (ctx->expiry && esp_timer_get_time() >= ctx->expiry) {
+      // The client gave up while the request was queued, skip the handler
+      AOS_ARGS_T(aos_jrpc_server_handler) *args =
+          aos_args_get(ctx->handler_future);
+      args->out_err = _AOS_JRPC_SERVER_ERR_EXPIRED;
+      aos_resolve(ctx->handler_future);
+    } else {
+      ctx->handler(ctx->params, ctx->handler_future);
+    }
+  }
+
+  xSemaphoreGive(server->pooldone);
+  vTaskDelete(NULL);
+}
+
+static void _aos_jrpc_server_task(void *arg) {
+  aos_jrpc_server_t *server = arg;
+  _aos_jrpc_server_input_t input = {0};
+
+  // A NULL input means stop
+  while (true) {
+    _aos_jrpc_server_lanes_receive(server->queue, server->taskbell, &input);
+    if (!input.data) {
+      break;
+    }
+    aos_future_config_t config = {.cb = _aos_jrpc_server_task_cb,
+                                  .ctx = server};
+    aos_future_t *future =
+        AOS_FUTURE_ALLOC_T(aos_jrpc_server_call)(&config, NULL, 0);
+    if (!future) {
+      ESP_LOGE(_tag, "Could not allocate call future, input dropped");
+      free(input.data);
+      continue;
+    }
+    _aos_jrpc_server_call_len(
+        server, input.data,
+        strnlen(input.data, server->config.maxinputlen + 1), future,
+        input.arrival);
+    free(input.data); // Requests don't reference input after parsing
+  }
+
+  xSemaphoreGive(server->taskdone);
+  vTaskDelete(NULL);
+}
+
+static bool _aos_jrpc_server_lanes_create(QueueHandle_t *lanes,
+                                          SemaphoreHandle_t *bell, size_t len,
+                                          size_t itemsize) {
+  // The semaphore counts items across queues, senders give it after queueing
+  // so whoever takes it always finds an item
+  *bell = xSemaphoreCreateCounting(AOS_JRPC_SERVER_PRIORITIES * len, 0);
+  for (size_t i = 0; i < AOS_JRPC_SERVER_PRIORITIES; i++) {
+    lanes[i] = xQueueCreate(len, itemsize);
+    if (!lanes[i]) {
+      return false;
+    }
+  }
+  return *bell;
+}
+
+static void _aos_jrpc_server_lanes_delete(QueueHandle_t *lanes,
+                                          SemaphoreHandle_t bell) {
+  for (size_t i = 0; i < AOS_JRPC_SERVER_PRIORITIES; i++) {
+    if (lanes[i]) {
+      vQueueDelete(lanes[i]);
+    }
+  }
+  if (bell) {
+    vSemaphoreDelete(bell);
+  }
+}
+
+static bool _aos_jrpc_server_lanes_send(QueueHandle_t *lanes,
+                                        SemaphoreHandle_t bell,
+                                        const void *item,
+                                        aos_jrpc_server_priority_t priority,
+                                        TickType_t timeout) {
+  if (xQueueSend(lanes[priority], item, timeout) != pdTRUE) {
+    return false;
+  }
+  xSemaphoreGive(bell);
+  return true;
+}
+
+static void _aos_jrpc_server_lanes_receive(QueueHandle_t *lanes,
+                                           SemaphoreHandle_t bell,
+                                           void *item) {
+  xSemaphoreTake(bell, portMAX_DELAY);
+  for (size_t i = AOS_JRPC_SERVER_PRIORITIES; i-- > 0;) {
+    if (xQueueReceive(lanes[i], item, 0) == pdTRUE) {
+      return;
+    }
+  }
+}
+
+static void _aos_jrpc_server_task_cb(aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
+  char *out_data = args->out_data;
+  unsigned int out_err = args->out_err;
+  aos_jrpc_server_t *server = aos_future_free(future);
+
+  if (out_err) {
+    ESP_LOGE(_tag, "Could not compute response");
+    return;
+  }
+  if (out_data) {
+    server->config.task.on_output(out_data, server->config.task.ctx);
+  }
+}
+
 AOS_DEFINE(aos_jrpc_server_call_json, cJSON *, unsigned int)
 void aos_jrpc_server_call_json(aos_jrpc_server_t *server, cJSON *data,
                                aos_future_t *future) {
-  AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
+  _aos_jrpc_server_dispatch(server, data, future, false, esp_timer_get_time());
+}
+
+static void _aos_jrpc_server_dispatch(aos_jrpc_server_t *server, cJSON *data,
+                                      aos_future_t *future, bool text,
+                                      int64_t arrival) {
+  // Shutting down?
+  if (!_aos_jrpc_server_inflight_enter(server)) {
+    _aos_jrpc_server_respond_error(
+        future, text, NULL, server->config.shutdowncode,
+        "Server error"); // NOTE: -32003 (default) means shutting down
+    aos_resolve(future);
+    return;
+  }
 
+  // Requests hold their own references, ours only covers dispatching. Batches
+  // are never dispatched in text mode.
   if (cJSON_IsObject(data)) {
-    _aos_jrpc_server_request_handle(server, data, future);
+    _aos_jrpc_server_request_handle(server, data, future, text, arrival);
   } else if (cJSON_IsArray(data)) {
     if (!server->config.parallel) {
-      _aos_jrpc_server_batch_handle_sequential(server, data, future);
+      _aos_jrpc_server_batch_handle_sequential(server, data, future, arrival);
     } else {
-      _aos_jrpc_server_batch_handle_parallel(server, data, future);
+      _aos_jrpc_server_batch_handle_parallel(server, data, future, arrival);
     }
   } else {
-    args->out_response =
-        aos_jrpc_message_error(NULL, -32600, "Invalid Request");
+    _aos_jrpc_server_respond_error(future, text, NULL, -32600,
+                                   "Invalid Request");
+    aos_resolve(future);
+  }
+  _aos_jrpc_server_inflight_release(server);
+}
+
+static void _aos_jrpc_server_respond(aos_future_t *future, bool text,
+                                     cJSON *response) {
+  // Callers expecting a response get an error if it could not be built
+  if (text) {
+    AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
+    args->out_data = cJSON_PrintUnformatted(response);
+    if (!args->out_data) {
+      args->out_err = 1;
+    }
+    cJSON_Delete(response);
+  } else {
+    AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
+    args->out_response = response;
     if (!args->out_response) {
       args->out_err = 1;
     }
-    aos_resolve(future);
   }
 }
 
-typedef struct _aos_jrpc_server_request_handle_ctx_t {
-  aos_future_t *future;
-  cJSON *id;
-  aos_jrpc_server_t *server;
-} _aos_jrpc_server_request_handle_ctx_t;
+static void _aos_jrpc_server_respond_error(aos_future_t *future, bool text,
+                                           cJSON *id, int code,
+                                           const char *msg) {
+  // Text errors are printed from a template, skipping the cJSON tree
+  if (text) {
+    AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
+    args->out_data = aos_jrpc_message_error_print(id, code, msg);
+    if (!args->out_data) {
+      args->out_err = 1;
+    }
+    return;
+  }
+  _aos_jrpc_server_respond(future, false,
+                           aos_jrpc_message_error(id, code, msg));
+}
+
+static void _aos_jrpc_server_respond_result(aos_future_t *future, bool text,
+                                            cJSON *id, cJSON *result) {
+  // Text results are written straight from the handler tree
+  if (text) {
+    AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
+    args->out_data = aos_jrpc_message_result_print(id, result);
+    if (!args->out_data) {
+      // Create an error response
+      _aos_jrpc_server_respond_error(future, true, id, -32603,
+                                     "Internal error");
+    }
+    return;
+  }
+  cJSON *response = aos_jrpc_message_result(id, result);
+  if (!response) {
+    // Create an error response
+    _aos_jrpc_server_respond_error(future, false, id, -32603,
+                                   "Internal error");
+    return;
+  }
+  _aos_jrpc_server_respond(future, false, response);
+}
+
+static void _aos_jrpc_server_respond_raw(aos_future_t *future, bool text,
+                                         cJSON *id, char *raw) {
+  // Serialized results are spliced as is, or wrapped in a raw item. Either
+  // way they are copied once and freed right away.
+  if (text) {
+    AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
+    args->out_data = aos_jrpc_message_result_raw_print(id, raw);
+    free(raw);
+    if (!args->out_data) {
+      // Create an error response
+      _aos_jrpc_server_respond_error(future, true, id, -32603,
+                                     "Internal error");
+    }
+    return;
+  }
+
+  // Envelope built in place, the raw item is attached without duplicating it
+  cJSON *response = cJSON_CreateObject();
+  cJSON *id_dup = cJSON_Duplicate(id, true);
+  cJSON *result = cJSON_CreateRaw(raw);
+  free(raw);
+  if (!response || !id_dup || !result ||
+      !cJSON_AddStringToObject(response, "jsonrpc", "2.0") ||
+      !cJSON_AddItemToObject(response, "id", id_dup)) {
+    cJSON_Delete(response);
+    cJSON_Delete(id_dup);
+    cJSON_Delete(result);
+    goto _aos_jrpc_server_respond_raw_err;
+  }
+  if (!cJSON_AddItemToObject(response, "result", result)) {
+    cJSON_Delete(response);
+    cJSON_Delete(result);
+    goto _aos_jrpc_server_respond_raw_err;
+  }
+  _aos_jrpc_server_respond(future, false, response);
+  return;
+
+_aos_jrpc_server_respond_raw_err:
+  // Create an error response
+  _aos_jrpc_server_respond_error(future, false, id, -32603, "Internal error");
+}
+
 static void _aos_jrpc_server_request_handle(aos_jrpc_server_t *server,
                                             cJSON *request,
-                                            aos_future_t *future) {
-  AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
-  cJSON *id = NULL;
+                                            aos_future_t *future, bool text,
+                                            int64_t arrival) {
+  _aos_jrpc_server_handler_limit_t *limit = NULL;
+  bool slot = false;
   _aos_jrpc_server_request_handle_ctx_t *ctx = NULL;
 
-  xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
-  server->counter++;
-  xSemaphoreGiveRecursive(server->semaphore);
-
-  // Too many requests?
-  if (server->counter >= server->config.maxrequests) {
-    args->out_response = aos_jrpc_message_error(
-        id, -32001, "Server error"); // NOTE: -32001 means too many requests
-    goto _aos_jrpc_server_request_handle_err;
-  }
+  // Keep the server alive until the request is resolved. References are
+  // released after resolving so that batches can dispatch their next item
+  // before the count may drop to zero.
+  _aos_jrpc_server_inflight_hold(server);
 
   // Is valid?
   if (!_aos_jrpc_server_isvalid(request)) {
     // Invalid payload
-    args->out_response = aos_jrpc_message_error(id, -32600, "Invalid Request");
+    _aos_jrpc_server_respond_error(future, text, NULL, -32600,
+                                   "Invalid Request");
     goto _aos_jrpc_server_request_handle_err;
   }
+  cJSON *request_id = cJSON_GetObjectItemCaseSensitive(request, "id");
+
+  // Has the client given up already? Budgets count from the message arrival,
+  // so time spent queued or behind earlier batch items is accounted for. The
+  // client timer started earlier, it always expires first.
+  int64_t expiry = 0;
+  cJSON *deadline_field =
+      server->config.deadlinefield
+          ? cJSON_GetObjectItemCaseSensitive(request,
+                                             server->config.deadlinefield)
+          : NULL;
+  if (cJSON_IsNumber(deadline_field)) {
+    expiry = arrival + (int64_t)(1000 * fmax(fmin(deadline_field->valuedouble,
+                                                  INT32_MAX),
+                                             0));
+    if (expiry <= esp_timer_get_time()) {
+      _aos_jrpc_server_respond_error(
+          future, text, request_id, -32006,
+          "Server error"); // NOTE: -32006 means client deadline expired
+      goto _aos_jrpc_server_request_handle_err;
+    }
+  }
 
-  // Get ID if any
-  id = cJSON_Duplicate(cJSON_GetObjectItemCaseSensitive(request, "id"), false);
-  if (cJSON_GetObjectItemCaseSensitive(request, "id") && !id) {
-    args->out_response = aos_jrpc_message_error(id, -32603, "Internal error");
+  // Fetch handler, rejecting calls over the method limits before allocating
+  // anything
+  aos_jrpc_server_handler_config_t handler_config;
+  switch (_aos_jrpc_server_handler_get(
+      server, cJSON_GetObjectItemCaseSensitive(request, "method")->valuestring,
+      &handler_config, &limit)) {
+  case _AOS_JRPC_SERVER_HANDLER_FOUND:
+    break;
+  case _AOS_JRPC_SERVER_HANDLER_MISSING:
+    _aos_jrpc_server_respond_error(future, text, request_id, -32601,
+                                   "Method not found");
     goto _aos_jrpc_server_request_handle_err;
+  case _AOS_JRPC_SERVER_HANDLER_LIMITED:
+    _aos_jrpc_server_respond_error(
+        future, text, request_id, -32004,
+        "Server error"); // NOTE: -32004 means method limit reached
+    goto _aos_jrpc_server_request_handle_err;
+  }
+
+  // Get priority class, the request may override the method one
+  aos_jrpc_server_priority_t priority = handler_config.priority;
+  cJSON *priority_field =
+      server->config.priorityfield
+          ? cJSON_GetObjectItemCaseSensitive(request,
+                                             server->config.priorityfield)
+          : NULL;
+  if (cJSON_IsNumber(priority_field) && priority_field->valueint >= 0 &&
+      priority_field->valueint < AOS_JRPC_SERVER_PRIORITIES) {
+    priority = priority_field->valueint;
   }
 
-  // UNIMPLEMENTED: Check id is not currently in use
-  // To do this we need to have a server struct containing pointers to current
-  // contexts, so that we can parse them to look whether an id is currently
-  // being used Together with this, we should also prevent the server from being
-  // freed if a request (which could be async) is currently in progress. To
-  // accomplish it, check if any id is currently being processed. We may also
-  // want a counter to account for notifications. Probably, to avoid race
-  // conditions it would be best to restructure the server in an async task for
-  // a 2.0 release. In such task, shutting down would mean to wait for the
-  // request counter to drop to zero (thus don't block task, only prevent new
-  // requests), then shutting down the task.
-
-  // Fetch handler
-  aos_jrpc_server_handler_t handler = _aos_jrpc_server_handler_get(
-      server, cJSON_GetObjectItemCaseSensitive(request, "method")->valuestring);
-  if (!handler) {
-    args->out_response = aos_jrpc_message_error(id, -32601, "Method not found");
+  // Too many requests? Reserve a slot before allocating anything, lower classes
+  // cannot take the reserved ones
+  slot = _aos_jrpc_server_slot_acquire(server, priority);
+  if (!slot) {
+    _aos_jrpc_server_respond_error(
+        future, text, request_id, -32001,
+        "Server error"); // NOTE: -32001 means too many requests
     goto _aos_jrpc_server_request_handle_err;
   }
 
-  // Alloc context
-  ctx = calloc(1, sizeof(_aos_jrpc_server_request_handle_ctx_t));
+  // Alloc context along with the ID copy and bound params, if they fit
+  size_t ctxsize =
+      sizeof(_aos_jrpc_server_request_handle_ctx_t) + handler_config.paramsize;
+  ctx = _aos_jrpc_server_freelist_get(server->requestctxs, ctxsize);
   if (!ctx) {
-    args->out_response = aos_jrpc_message_error(id, -32603, "Internal error");
+    _aos_jrpc_server_respond_error(future, text, request_id, -32603,
+                                   "Internal error");
     goto _aos_jrpc_server_request_handle_err;
   }
+  ctx->freelist = server->requestctxs;
   ctx->future = future;
-  ctx->id = id;
+  ctx->text = text;
+  ctx->validateraw = handler_config.validateraw;
   ctx->server = server;
+  ctx->limit = limit;
+  ctx->deadlineindex = SIZE_MAX;
+  ctx->expiry = expiry;
+  bool pooled = handler_config.pooled && server->poolbell;
+  atomic_init(&ctx->state, pooled ? _AOS_JRPC_SERVER_REQUEST_QUEUED
+                                  : _AOS_JRPC_SERVER_REQUEST_RUNNING);
+  ctx->id = _aos_jrpc_server_request_id_copy(ctx, request_id);
+  if (request_id && !ctx->id) {
+    _aos_jrpc_server_respond_error(future, text, request_id, -32603,
+                                   "Internal error");
+    goto _aos_jrpc_server_request_handle_err;
+  }
+
+  // Check id is not currently in use
+  if (ctx->id && !_aos_jrpc_server_id_track(server, ctx->id)) {
+    _aos_jrpc_server_respond_error(
+        future, text, ctx->id, -32002,
+        "Server error"); // NOTE: -32002 means duplicate id
+    goto _aos_jrpc_server_request_handle_err;
+  }
+
+  // Bind params, calls that do not match the descriptors never reach the
+  // handler. Pooled handlers get a copy of params living until the handler
+  // resolves, others only get copies of the bound members referencing them.
+  cJSON *params = cJSON_GetObjectItemCaseSensitive(request, "params");
+  if (pooled) {
+    ctx->params = cJSON_Duplicate(params, true);
+    if (params && !ctx->params) {
+      _aos_jrpc_server_respond_error(future, text, ctx->id, -32603,
+                                     "Internal error");
+      goto _aos_jrpc_server_request_handle_err;
+    }
+    params = ctx->params;
+  }
+  if (handler_config.nparams) {
+    ctx->bound = ctx->storage;
+    if (!_aos_jrpc_server_params_bind(&handler_config, params, ctx->bound)) {
+      _aos_jrpc_server_respond_error(future, text, ctx->id, -32602,
+                                     "Invalid params");
+      goto _aos_jrpc_server_request_handle_err;
+    }
+    size_t room = ctxsize > server->requestctxs->size
+                      ? 0
+                      : server->requestctxs->size - ctxsize;
+    if (!pooled &&
+        !_aos_jrpc_server_params_detach(&handler_config, ctx, room)) {
+      _aos_jrpc_server_respond_error(future, text, ctx->id, -32603,
+                                     "Internal error");
+      goto _aos_jrpc_server_request_handle_err;
+    }
+  }
 
   // Alloc future
   aos_future_config_t handler_future_config = {
@@ -276,104 +1270,748 @@ static void _aos_jrpc_server_request_handle(aos_jrpc_server_t *server,
   aos_future_t *handler_future = AOS_FUTURE_ALLOC_T(aos_jrpc_server_handler)(
       &handler_future_config, NULL, 0);
   if (!handler_future) {
-    args->out_response = aos_jrpc_message_error(id, -32603, "Internal error");
+    _aos_jrpc_server_respond_error(future, text, ctx->id, -32603,
+                                   "Internal error");
     goto _aos_jrpc_server_request_handle_err;
   }
+  AOS_ARGS_T(aos_jrpc_server_handler) *handler_args =
+      aos_args_get(handler_future);
+  handler_args->in_params = ctx->bound;
+
+  // Start the clock, the handler may complete before we get to do it later
+  uint32_t timeout =
+      handler_config.timeout ? handler_config.timeout : server->config.timeout;
+  if (timeout) {
+    ctx->deadline = esp_timer_get_time() + 1000 * (int64_t)timeout;
+    _aos_jrpc_server_deadline_add(server, ctx);
+  }
 
-  // Launch handler
-  handler(cJSON_GetObjectItemCaseSensitive(request, "params"), handler_future);
+  // Launch handler, on the worker pool if requested
+  if (pooled) {
+    ctx->handler = handler_config.handler;
+    ctx->handler_future = handler_future;
+    if (!_aos_jrpc_server_lanes_send(server->pool, server->poolbell, &ctx,
+                                     priority, 0)) {
+      unsigned int state = _AOS_JRPC_SERVER_REQUEST_QUEUED;
+      if (!atomic_compare_exchange_strong(&ctx->state, &state,
+                                          _AOS_JRPC_SERVER_REQUEST_DONE)) {
+        // Timed out meanwhile, the request was answered already
+        aos_future_free(handler_future);
+        _aos_jrpc_server_slot_release(server);
+        _aos_jrpc_server_request_abandon(ctx);
+        return;
+      }
+      _aos_jrpc_server_deadline_remove(server, ctx);
+      aos_future_free(handler_future);
+      _aos_jrpc_server_respond_error(future, text, ctx->id, -32603,
+                                     "Internal error");
+      goto _aos_jrpc_server_request_handle_err;
+    }
+    return;
+  }
+  handler_config.handler(params, handler_future);
   return;
 
 _aos_jrpc_server_request_handle_err:
-  free(ctx);
-  cJSON_Delete(id);
-  if (!args->out_response) {
-    args->out_err = 1;
+  if (ctx) {
+    _aos_jrpc_server_id_untrack(server, ctx->id); // No-op if not tracked
+    _aos_jrpc_server_request_free(ctx);
+  }
+  _aos_jrpc_server_handler_limit_refund(limit);
+  _aos_jrpc_server_handler_limit_release(limit);
+  if (slot) {
+    _aos_jrpc_server_slot_release(server);
   }
-  xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
-  server->counter--;
-  xSemaphoreGiveRecursive(server->semaphore);
   aos_resolve(future);
+  _aos_jrpc_server_inflight_release(server);
 }
 static void _aos_jrpc_server_request_handle_cb(aos_future_t *future) {
   AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
   unsigned int out_err = args->out_err;
   cJSON *out_result = args->out_result;
+  char *out_raw = args->out_raw;
   _aos_jrpc_server_request_handle_ctx_t *ctx = aos_future_free(future);
 
-  // Disassemble ctx for convenience
+  // Too late? The timeout response is gone already, along with the server
+  // resources held by the request
+  unsigned int state = _AOS_JRPC_SERVER_REQUEST_RUNNING;
+  if (!atomic_compare_exchange_strong(&ctx->state, &state,
+                                      _AOS_JRPC_SERVER_REQUEST_DONE)) {
+    cJSON_Delete(out_result);
+    free(out_raw);
+    _aos_jrpc_server_request_abandon(ctx);
+    return;
+  }
+  if (ctx->deadline) {
+    _aos_jrpc_server_deadline_remove(ctx->server, ctx);
+  }
+
+  // Disassemble ctx for convenience, it holds the ID until responding
   cJSON *id = ctx->id;
   aos_jrpc_server_t *server = ctx->server;
   aos_future_t *call_future = ctx->future;
-  free(ctx);
-
-  AOS_ARGS_T(aos_jrpc_server_call_json) *call_args = aos_args_get(call_future);
+  bool text = ctx->text;
+  _aos_jrpc_server_handler_limit_release(ctx->limit);
+  _aos_jrpc_server_id_untrack(server, id);
 
   /* Check return value */
   switch (out_err) {
   case 0: {
     // All good, is it a notification?
     if (!id) {
-      cJSON_Delete(id);
+      _aos_jrpc_server_request_free(ctx);
       cJSON_Delete(out_result);
-      xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
-      server->counter--;
-      xSemaphoreGiveRecursive(server->semaphore);
+      free(out_raw);
+      _aos_jrpc_server_slot_release(server);
       aos_resolve(call_future);
+      _aos_jrpc_server_inflight_release(server);
       return;
     }
 
-    // Response required, let's build it
-    call_args->out_response = aos_jrpc_message_result(id, out_result);
-    if (!call_args->out_response) {
+    // Response required, let's build it. Serialized results take precedence.
+    if (!out_raw) {
+      _aos_jrpc_server_respond_result(call_future, text, id, out_result);
+    } else if (!ctx->validateraw ||
+               aos_jrpc_message_isvalid(out_raw, strlen(out_raw))) {
+      _aos_jrpc_server_respond_raw(call_future, text, id, out_raw);
+      out_raw = NULL; // Freed once copied
+    } else {
       // Create an error response
-      call_args->out_response =
-          aos_jrpc_message_error(id, -32603, "Internal error");
+      _aos_jrpc_server_respond_error(call_future, text, id, -32603,
+                                     "Internal error");
     }
     goto _aos_jrpc_server_request_handle_cb_end;
   }
   case AOS_JRPC_SERVER_ERR_INVALIDPARAMS: {
     // Create an error response
-    call_args->out_response =
-        aos_jrpc_message_error(id, -32602, "Invalid params");
+    _aos_jrpc_server_respond_error(call_future, text, id, -32602,
+                                   "Invalid params");
+    goto _aos_jrpc_server_request_handle_cb_end;
+  }
+  case _AOS_JRPC_SERVER_ERR_EXPIRED: {
+    // Create an error response
+    _aos_jrpc_server_respond_error(
+        call_future, text, id, -32006,
+        "Server error"); // NOTE: -32006 means client deadline expired
     goto _aos_jrpc_server_request_handle_cb_end;
   }
   default: {
     // Create an error response
-    call_args->out_response =
-        aos_jrpc_message_error(id, -32603, "Internal error");
+    _aos_jrpc_server_respond_error(call_future, text, id, -32603,
+                                   "Internal error");
     goto _aos_jrpc_server_request_handle_cb_end;
   }
   }
 
 _aos_jrpc_server_request_handle_cb_end:
-  if (!call_args->out_response) {
-    call_args->out_err = 1;
-  }
-  cJSON_Delete(id);
+  _aos_jrpc_server_request_free(ctx);
   cJSON_Delete(out_result);
-  xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
-  server->counter--;
-  xSemaphoreGiveRecursive(server->semaphore);
+  free(out_raw);
+  _aos_jrpc_server_slot_release(server);
   aos_resolve(call_future);
+  _aos_jrpc_server_inflight_release(server);
   return;
 }
 
+static cJSON *
+_aos_jrpc_server_request_id_copy(_aos_jrpc_server_request_handle_ctx_t *ctx,
+                                 cJSON *id) {
+  // Numbers, nulls and short strings are kept inline
+  if (cJSON_IsNumber(id) || cJSON_IsNull(id)) {
+    ctx->idbuf.type = id->type & 0xFF;
+    ctx->idbuf.valueint = id->valueint;
+    ctx->idbuf.valuedouble = id->valuedouble;
+    return &ctx->idbuf;
+  }
+  if (cJSON_IsString(id) && strlen(id->valuestring) < sizeof(ctx->idstr)) {
+    strcpy(ctx->idstr, id->valuestring);
+    ctx->idbuf.type = cJSON_String | cJSON_IsReference;
+    ctx->idbuf.valuestring = ctx->idstr;
+    return &ctx->idbuf;
+  }
+  return cJSON_Duplicate(id, false);
+}
+
+static void
+_aos_jrpc_server_request_free(_aos_jrpc_server_request_handle_ctx_t *ctx) {
+  if (ctx->id != &ctx->idbuf) {
+    cJSON_Delete(ctx->id);
+  }
+  cJSON_Delete(ctx->params);
+  free(ctx->strings);
+  _aos_jrpc_server_freelist_put(ctx->freelist, ctx);
+}
+
+static void
+_aos_jrpc_server_request_abandon(_aos_jrpc_server_request_handle_ctx_t *ctx) {
+  // Timed out requests are shared by the timer and the handler or worker, the
+  // last one done with it frees it
+  if (atomic_fetch_add(&ctx->abandoned, 1)) {
+    _aos_jrpc_server_request_free(ctx);
+  }
+}
+
+/**
+ * Admission gate
+ */
+static bool _aos_jrpc_server_slot_acquire(aos_jrpc_server_t *server,
+                                          aos_jrpc_server_priority_t priority) {
+  size_t max = priority == AOS_JRPC_SERVER_PRIORITY_HIGH
+                   ? server->config.maxrequests
+                   : server->config.maxrequests - server->config.reserved;
+  unsigned int counter = atomic_load(&server->counter);
+  do {
+    if (counter >= max) {
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak(&server->counter, &counter,
+                                         counter + 1));
+  return true;
+}
+
+static void _aos_jrpc_server_slot_release(aos_jrpc_server_t *server) {
+  atomic_fetch_sub(&server->counter, 1);
+}
+
+/**
+ * Method limits
+ */
+static _aos_jrpc_server_handler_limit_t *
+_aos_jrpc_server_handler_limit_alloc(
+    const aos_jrpc_server_handler_config_t *config) {
+  _aos_jrpc_server_handler_limit_t *limit =
+      calloc(1, sizeof(_aos_jrpc_server_handler_limit_t));
+  if (!limit) {
+    return NULL;
+  }
+  atomic_init(&limit->refs, 1);
+  atomic_init(&limit->concurrent, 0);
+  limit->bounded = config->maxconcurrent;
+  portMUX_INITIALIZE(&limit->lock);
+  if (config->rate) {
+    limit->full = (int64_t)(config->burst ? config->burst : 1) *
+                  _AOS_JRPC_SERVER_HANDLER_TOKEN;
+  }
+  limit->tokens = limit->full;
+  limit->stamp = esp_timer_get_time();
+  return limit;
+}
+
+static bool _aos_jrpc_server_handler_limit_acquire(
+    _aos_jrpc_server_handler_entry_t *entry,
+    _aos_jrpc_server_handler_limit_t **held) {
+  // NOTE: Called while the entry cannot be reclaimed
+  _aos_jrpc_server_handler_limit_t *limit = entry->limit;
+  aos_jrpc_server_handler_config_t *config = &entry->config;
+  *held = NULL;
+  if (!limit) {
+    return true;
+  }
+
+  // Take a concurrency slot
+  if (config->maxconcurrent) {
+    size_t concurrent = atomic_load(&limit->concurrent);
+    do {
+      if (concurrent >= config->maxconcurrent) {
+        return false;
+      }
+    } while (!atomic_compare_exchange_weak(&limit->concurrent, &concurrent,
+                                           concurrent + 1));
+  }
+
+  // Refill the bucket for the time elapsed and take a token
+  if (config->rate) {
+    int64_t now = esp_timer_get_time();
+    int64_t full = limit->full;
+    int64_t window = config->ratewindow ? config->ratewindow : 1000;
+    taskENTER_CRITICAL(&limit->lock);
+    int64_t elapsed = now - limit->stamp;
+    if (elapsed >= full * window / (1000 * (int64_t)config->rate)) {
+      limit->tokens = full;
+    } else if (elapsed > 0) {
+      limit->tokens += elapsed * config->rate * 1000 / window;
+      limit->tokens = limit->tokens < full ? limit->tokens : full;
+    }
+    limit->stamp = now > limit->stamp ? now : limit->stamp;
+    bool taken = limit->tokens >= _AOS_JRPC_SERVER_HANDLER_TOKEN;
+    if (taken) {
+      limit->tokens -= _AOS_JRPC_SERVER_HANDLER_TOKEN;
+    }
+    taskEXIT_CRITICAL(&limit->lock);
+    if (!taken) {
+      if (config->maxconcurrent) {
+        atomic_fetch_sub(&limit->concurrent, 1);
+      }
+      return false;
+    }
+  }
+
+  // Keep the limits alive until released, the token may be refunded
+  atomic_fetch_add(&limit->refs, 1);
+  *held = limit;
+  return true;
+}
+
+static void
+_aos_jrpc_server_handler_limit_refund(_aos_jrpc_server_handler_limit_t *limit) {
+  // Calls rejected before reaching the handler give their token back
+  if (!limit || !limit->full) {
+    return;
+  }
+  taskENTER_CRITICAL(&limit->lock);
+  limit->tokens += _AOS_JRPC_SERVER_HANDLER_TOKEN;
+  limit->tokens = limit->tokens < limit->full ? limit->tokens : limit->full;
+  taskEXIT_CRITICAL(&limit->lock);
+}
+
+static void _aos_jrpc_server_handler_limit_release(
+    _aos_jrpc_server_handler_limit_t *limit) {
+  if (!limit) {
+    return;
+  }
+  if (limit->bounded) {
+    atomic_fetch_sub(&limit->concurrent, 1);
+  }
+  _aos_jrpc_server_handler_limit_unref(limit);
+}
+
+static void
+_aos_jrpc_server_handler_limit_unref(_aos_jrpc_server_handler_limit_t *limit) {
+  if (limit && atomic_fetch_sub(&limit->refs, 1) == 1) {
+    free(limit);
+  }
+}
+
+/**
+ * Deadlines, a binary min-heap of running requests with a single timer armed
+ * for the earliest one. Entries leave the heap under its lock, so expiry can
+ * safely race with completion on the request state.
+ */
+static void _aos_jrpc_server_deadline_add(
+    aos_jrpc_server_t *server, _aos_jrpc_server_request_handle_ctx_t *ctx) {
+  taskENTER_CRITICAL(&server->deadlineslock);
+  ctx->deadlineindex = server->deadlinescount++;
+  server->deadlines[ctx->deadlineindex] = ctx;
+  _aos_jrpc_server_deadline_sift(server, ctx->deadlineindex);
+  bool earliest = !ctx->deadlineindex;
+  taskEXIT_CRITICAL(&server->deadlineslock);
+
+  if (earliest) {
+    _aos_jrpc_server_deadline_arm(server);
+  }
+}
+
+static void _aos_jrpc_server_deadline_remove(
+    aos_jrpc_server_t *server, _aos_jrpc_server_request_handle_ctx_t *ctx) {
+  // The timer may fire early for nothing if this was the earliest deadline
+  taskENTER_CRITICAL(&server->deadlineslock);
+  size_t index = ctx->deadlineindex;
+  if (index != SIZE_MAX) {
+    ctx->deadlineindex = SIZE_MAX;
+    if (index != --server->deadlinescount) {
+      server->deadlines[index] = server->deadlines[server->deadlinescount];
+      server->deadlines[index]->deadlineindex = index;
+      _aos_jrpc_server_deadline_sift(server, index);
+    }
+  }
+  taskEXIT_CRITICAL(&server->deadlineslock);
+}
+
+static void _aos_jrpc_server_deadline_sift(aos_jrpc_server_t *server,
+                                           size_t index) {
+  _aos_jrpc_server_request_handle_ctx_t **heap = server->deadlines;
+  _aos_jrpc_server_request_handle_ctx_t *ctx = heap[index];
+
+  // Move up while earlier than the parent, otherwise down while later than the
+  // earliest child
+  while (index && ctx->deadline < heap[(index - 1) / 2]->deadline) {
+    heap[index] = heap[(index - 1) / 2];
+    heap[index]->deadlineindex = index;
+    index = (index - 1) / 2;
+  }
+  while (2 * index + 1 < server->deadlinescount) {
+    size_t child = 2 * index + 1;
+    if (child + 1 < server->deadlinescount &&
+        heap[child + 1]->deadline < heap[child]->deadline) {
+      child++;
+    }
+    if (ctx->deadline <= heap[child]->deadline) {
+      break;
+    }
+    heap[index] = heap[child];
+    heap[index]->deadlineindex = index;
+    index = child;
+  }
+  heap[index] = ctx;
+  ctx->deadlineindex = index;
+}
+
+static void _aos_jrpc_server_deadline_arm(aos_jrpc_server_t *server) {
+  // Serialized so that the last update always sees the latest earliest
+  // deadline
+  xSemaphoreTake(server->timerlock, portMAX_DELAY);
+  taskENTER_CRITICAL(&server->deadlineslock);
+  int64_t deadline =
+      server->deadlinescount ? server->deadlines[0]->deadline : 0;
+  taskEXIT_CRITICAL(&server->deadlineslock);
+  esp_timer_stop(server->timer); // Fails if not running, that's fine
+  if (deadline) {
+    int64_t delay = deadline - esp_timer_get_time();
+    esp_timer_start_once(server->timer, delay > 0 ? delay : 0);
+  }
+  xSemaphoreGive(server->timerlock);
+}
+
+static void _aos_jrpc_server_deadline_cb(void *arg) {
+  aos_jrpc_server_t *server = arg;
+
+  // Only pop and claim expired requests here. Answering them runs caller
+  // continuations, which must not hold up the shared timer task.
+  taskENTER_CRITICAL(&server->deadlineslock);
+  while (server->deadlinescount &&
+         server->deadlines[0]->deadline <= esp_timer_get_time()) {
+    _aos_jrpc_server_request_handle_ctx_t *ctx = server->deadlines[0];
+    ctx->deadlineindex = SIZE_MAX;
+    if (--server->deadlinescount) {
+      server->deadlines[0] = server->deadlines[server->deadlinescount];
+      _aos_jrpc_server_deadline_sift(server, 0);
+    }
+    unsigned int state = atomic_load(&ctx->state);
+    while ((state == _AOS_JRPC_SERVER_REQUEST_RUNNING ||
+            state == _AOS_JRPC_SERVER_REQUEST_QUEUED) &&
+           !atomic_compare_exchange_weak(&ctx->state, &state,
+                                         _AOS_JRPC_SERVER_REQUEST_TIMEDOUT)) {
+    }
+    if (state == _AOS_JRPC_SERVER_REQUEST_RUNNING ||
+        state == _AOS_JRPC_SERVER_REQUEST_QUEUED) {
+      ctx->reapqueued = state == _AOS_JRPC_SERVER_REQUEST_QUEUED;
+      ctx->reapnext = server->reaped;
+      server->reaped = ctx;
+    }
+  }
+  taskEXIT_CRITICAL(&server->deadlineslock);
+
+  // The reaper rearms the timer, even if nothing expired
+  xSemaphoreGive(server->reaperbell);
+}
+
+/**
+ * Reaper, a task answering timed out requests in place of their handler
+ */
+static bool _aos_jrpc_server_reaper_start(aos_jrpc_server_t *server) {
+  // Callers serialize starts
+  if (server->reaper) {
+    return true;
+  }
+  if (!server->reaperbell) {
+    server->reaperbell = xSemaphoreCreateBinary();
+  }
+  if (!server->reaperdone) {
+    server->reaperdone = xSemaphoreCreateBinary();
+  }
+  if (!server->reaperbell || !server->reaperdone ||
+      xTaskCreatePinnedToCore(_aos_jrpc_server_reaper, "aos_jrpc_reaper",
+                              server->config.reaper.stacksize, server,
+                              server->config.reaper.priority, &server->reaper,
+                              tskNO_AFFINITY) != pdPASS) {
+    server->reaper = NULL;
+    return false;
+  }
+  return true;
+}
+
+static void _aos_jrpc_server_reaper_stop(aos_jrpc_server_t *server) {
+  if (server->reaper) {
+    taskENTER_CRITICAL(&server->deadlineslock);
+    server->reaperstop = true;
+    taskEXIT_CRITICAL(&server->deadlineslock);
+    xSemaphoreGive(server->reaperbell);
+    xSemaphoreTake(server->reaperdone, portMAX_DELAY);
+    server->reaper = NULL;
+  }
+}
+
+static void _aos_jrpc_server_reaper_delete(aos_jrpc_server_t *server) {
+  if (server->reaperbell) {
+    vSemaphoreDelete(server->reaperbell);
+  }
+  if (server->reaperdone) {
+    vSemaphoreDelete(server->reaperdone);
+  }
+}
+
+static void _aos_jrpc_server_reaper(void *arg) {
+  aos_jrpc_server_t *server = arg;
+
+  while (true) {
+    xSemaphoreTake(server->reaperbell, portMAX_DELAY);
+    taskENTER_CRITICAL(&server->deadlineslock);
+    _aos_jrpc_server_request_handle_ctx_t *reaped = server->reaped;
+    server->reaped = NULL;
+    bool stop = server->reaperstop;
+    taskEXIT_CRITICAL(&server->deadlineslock);
+    if (stop) {
+      break; // Stopped once nothing is in flight, nothing can be reaped
+    }
+
+    // Our own releases may complete a shutdown, keep the server until we are
+    // done
+    _aos_jrpc_server_inflight_hold(server);
+
+    // Earliest first
+    _aos_jrpc_server_request_handle_ctx_t *ctx = NULL;
+    while (reaped) {
+      _aos_jrpc_server_request_handle_ctx_t *next = reaped->reapnext;
+      reaped->reapnext = ctx;
+      ctx = reaped;
+      reaped = next;
+    }
+
+    // Reply in place of the handler and release what the request holds. The
+    // handler may be done with ctx meanwhile, which stays until we are too.
+    while (ctx) {
+      _aos_jrpc_server_request_handle_ctx_t *next = ctx->reapnext;
+      aos_future_t *future = ctx->future;
+      bool queued = ctx->reapqueued;
+      if (ctx->id) {
+        _aos_jrpc_server_respond_error(
+            future, ctx->text, ctx->id, -32005,
+            "Server error"); // NOTE: -32005 means handler timed out
+      }
+      _aos_jrpc_server_handler_limit_release(ctx->limit);
+      _aos_jrpc_server_id_untrack(server, ctx->id);
+      _aos_jrpc_server_request_abandon(ctx);
+      if (!queued) {
+        _aos_jrpc_server_slot_release(server);
+      }
+      aos_resolve(future);
+      _aos_jrpc_server_inflight_release(server);
+      ctx = next;
+    }
+
+    _aos_jrpc_server_deadline_arm(server);
+    _aos_jrpc_server_inflight_release(server);
+  }
+
+  xSemaphoreGive(server->reaperdone);
+  vTaskDelete(NULL);
+}
+
+/**
+ * Request arenas
+ */
+void aos_jrpc_server_arena_install(void) {
+  // Hooks are process-wide and cJSON cannot restore the previous ones, so
+  // they stay installed for every cJSON user
+  static atomic_flag installed = ATOMIC_FLAG_INIT;
+  if (!atomic_flag_test_and_set(&installed)) {
+    cJSON_Hooks hooks = {.malloc_fn = _aos_jrpc_server_arena_malloc,
+                         .free_fn = _aos_jrpc_server_arena_free};
+    cJSON_InitHooks(&hooks);
+    atomic_store(&_aos_jrpc_server_arena_installed, true);
+  }
+}
+
+static void *_aos_jrpc_server_arena_malloc(size_t size) {
+  _aos_jrpc_server_arena_t *arena = _aos_jrpc_server_arena;
+  if (!arena) {
+    return malloc(size);
+  }
+
+  // Bump the most recent block, chain a new one if full
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+  _aos_jrpc_server_arena_block_t *block = arena->blocks;
+  if (!block || block->size - block->used < size) {
+    size_t blocksize = size > arena->blocksize ? size : arena->blocksize;
+    block = malloc(sizeof(_aos_jrpc_server_arena_block_t) + blocksize);
+    if (!block) {
+      return NULL;
+    }
+    block->next = arena->blocks;
+    block->size = blocksize;
+    block->used = 0;
+    arena->blocks = block;
+  }
+  void *ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+static void _aos_jrpc_server_arena_free(void *ptr) {
+  // The arena is only open on this task for the duration of cJSON_Parse,
+  // which only frees its own nodes. Anything freed meanwhile is arena memory
+  // going away with the whole arena, every other free goes to the heap.
+  if (!_aos_jrpc_server_arena) {
+    free(ptr);
+  }
+}
+
+static cJSON *_aos_jrpc_server_arena_parse(_aos_jrpc_server_arena_t *arena,
+                                           const char *data, size_t len) {
+  if (!arena->blocksize || !atomic_load(&_aos_jrpc_server_arena_installed)) {
+    arena->blocksize = 0; // Deleted from the heap as well
+    return cJSON_ParseWithLength(data, len);
+  }
+  _aos_jrpc_server_arena = arena;
+  cJSON *json = cJSON_ParseWithLength(data, len);
+  _aos_jrpc_server_arena = NULL;
+  return json;
+}
+
+static void _aos_jrpc_server_arena_delete(_aos_jrpc_server_arena_t *arena,
+                                          cJSON *json) {
+  if (!arena->blocksize) {
+    cJSON_Delete(json);
+    return;
+  }
+
+  // Requests don't reference input after dispatching, nor take nodes from it
+  while (arena->blocks) {
+    _aos_jrpc_server_arena_block_t *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+}
+
+/**
+ * In-flight references
+ */
+static bool _aos_jrpc_server_inflight_enter(aos_jrpc_server_t *server) {
+  unsigned int inflight = atomic_load(&server->inflight);
+  do {
+    if (inflight & _AOS_JRPC_SERVER_SHUTDOWN) {
+      return false;
+    }
+  } while (!atomic_compare_exchange_weak(&server->inflight, &inflight,
+                                         inflight + 1));
+  return true;
+}
+
+static void _aos_jrpc_server_inflight_hold(aos_jrpc_server_t *server) {
+  // Only called while another reference is held, ignore the shutdown flag
+  atomic_fetch_add(&server->inflight, 1);
+}
+
+static void _aos_jrpc_server_inflight_release(aos_jrpc_server_t *server) {
+  unsigned int inflight = atomic_fetch_sub(&server->inflight, 1);
+  if (inflight == (_AOS_JRPC_SERVER_SHUTDOWN | 1)) {
+    // Last reference after shutdown, the server is drained
+    aos_future_t *future = atomic_exchange(&server->shutdown, NULL);
+    if (future) {
+      aos_resolve(future);
+    }
+  }
+}
+
+/**
+ * Active IDs
+ */
+static uint32_t _aos_jrpc_server_id_hash(cJSON *id) {
+  if (cJSON_IsString(id)) {
+    size_t len = 0;
+    return _aos_jrpc_server_hash(id->valuestring, &len);
+  }
+  double value = id->valuedouble == 0 ? 0 : id->valuedouble; // Fold -0
+  uint64_t bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+  return _aos_jrpc_server_hash_mix((uint32_t)bits ^ (uint32_t)(bits >> 32), 1);
+}
+
+static bool _aos_jrpc_server_id_equal(cJSON *a, cJSON *b) {
+  if (cJSON_IsString(a)) {
+    return cJSON_IsString(b) && !strcmp(a->valuestring, b->valuestring);
+  }
+  return cJSON_IsNumber(b) && a->valuedouble == b->valuedouble;
+}
+
+static bool _aos_jrpc_server_id_track(aos_jrpc_server_t *server, cJSON *id) {
+  // Null IDs cannot be told apart, don't track them
+  if (!cJSON_IsNumber(id) && !cJSON_IsString(id)) {
+    return true;
+  }
+  uint32_t hash = _aos_jrpc_server_id_hash(id);
+  size_t mask = server->idscapacity - 1;
+
+  taskENTER_CRITICAL(&server->idslock);
+  size_t slot = hash & mask;
+  for (; server->ids[slot].id; slot = (slot + 1) & mask) {
+    if (server->ids[slot].hash == hash &&
+        _aos_jrpc_server_id_equal(server->ids[slot].id, id)) {
+      taskEXIT_CRITICAL(&server->idslock);
+      return false;
+    }
+  }
+  server->ids[slot] = (_aos_jrpc_server_id_entry_t){.hash = hash, .id = id};
+  taskEXIT_CRITICAL(&server->idslock);
+  return true;
+}
+
+static void _aos_jrpc_server_id_untrack(aos_jrpc_server_t *server, cJSON *id) {
+  if (!cJSON_IsNumber(id) && !cJSON_IsString(id)) {
+    return;
+  }
+  uint32_t hash = _aos_jrpc_server_id_hash(id);
+  size_t mask = server->idscapacity - 1;
+
+  taskENTER_CRITICAL(&server->idslock);
+  size_t slot = hash & mask;
+  while (server->ids[slot].id && server->ids[slot].id != id) {
+    slot = (slot + 1) & mask;
+  }
+  if (!server->ids[slot].id) {
+    taskEXIT_CRITICAL(&server->idslock);
+    return;
+  }
+  server->ids[slot].id = NULL;
+
+  // Backward-shift the following cluster, probing never needs tombstones
+  size_t hole = slot;
+  for (size_t next = (slot + 1) & mask; server->ids[next].id;
+       next = (next + 1) & mask) {
+    size_t home = server->ids[next].hash & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      server->ids[hole] = server->ids[next];
+      server->ids[next].id = NULL;
+      hole = next;
+    }
+  }
+  taskEXIT_CRITICAL(&server->idslock);
+}
+
 /**
  * Sequential batch
+ * Items are walked in place by cursor. As long as they complete synchronously
+ * the caller's array is still valid, so it is only copied (from the current
+ * item on) once an item goes asynchronous and we have to return to the caller.
+ * The state handshake tells the dispatcher whether the completion callback ran
+ * before it returned, and otherwise hands dispatching over to the callback.
+ * Either way the dispatcher is a trampoline: synchronous completions only flag
+ * the state and return, and the loop moves on to the next item. Stack depth
+ * does not depend on batch length.
  */
+typedef enum _aos_jrpc_server_batch_state_t {
+  _AOS_JRPC_SERVER_BATCH_DISPATCHING = 0, // Item launched, dispatcher running
+  _AOS_JRPC_SERVER_BATCH_COMPLETED, // Item completed, dispatcher carries on
+  _AOS_JRPC_SERVER_BATCH_PENDING, // Dispatcher returned, callback carries on
+} _aos_jrpc_server_batch_state_t;
+
 typedef struct _aos_jrpc_server_batch_handle_sequential_ctx_t {
-  size_t counter;
   aos_jrpc_server_t *server;
-  cJSON *request;
   aos_future_t *future;
+  cJSON *item;      // Next item to dispatch
+  cJSON *remainder; // Owned copy of the remaining items, NULL if borrowing
+  int64_t arrival;  // Client deadlines of every item count from here
+  atomic_uint state;
+  bool fail;
 } _aos_jrpc_server_batch_handle_sequential_ctx_t;
+static void _aos_jrpc_server_batch_handle_sequential_run(
+    _aos_jrpc_server_batch_handle_sequential_ctx_t *ctx);
 static void _aos_jrpc_server_batch_handle_sequential(aos_jrpc_server_t *server,
                                                      cJSON *request,
-                                                     aos_future_t *future) {
+                                                     aos_future_t *future,
+                                                     int64_t arrival) {
   AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
   _aos_jrpc_server_batch_handle_sequential_ctx_t *ctx = NULL;
-  cJSON *request_dup = NULL;
 
   // Check for invalid arrays
   if (!cJSON_GetArraySize(request)) {
@@ -383,38 +2021,98 @@ static void _aos_jrpc_server_batch_handle_sequential(aos_jrpc_server_t *server,
   }
 
   // Allocate context
-  ctx = calloc(1, sizeof(_aos_jrpc_server_batch_handle_sequential_ctx_t));
-  request_dup = cJSON_Duplicate(request, true);
-  if (!ctx || !request_dup) {
+  ctx = _aos_jrpc_server_freelist_get(
+      server->batchctxs,
+      sizeof(_aos_jrpc_server_batch_handle_sequential_ctx_t));
+  if (!ctx) {
     goto _aos_jrpc_server_batch_handle_sequential_err;
   }
   ctx->server = server;
   ctx->future = future;
-  ctx->request = request_dup;
-  ctx->counter = cJSON_GetArraySize(request);
+  ctx->item = request->child;
+  ctx->arrival = arrival;
 
-  // Start first processing
-  aos_future_config_t config = {
-      .cb = _aos_jrpc_server_batch_handle_sequential_cb, .ctx = ctx};
-  aos_future_t *req_future =
-      AOS_FUTURE_ALLOC_T(aos_jrpc_server_call_json)(&config, NULL, 0);
-  if (!req_future) {
-    args->out_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
-    goto _aos_jrpc_server_batch_handle_sequential_err;
-  }
-  cJSON *item = cJSON_DetachItemFromArray(request_dup, 0);
-  _aos_jrpc_server_request_handle(server, item, req_future);
-  cJSON_Delete(item);
+  _aos_jrpc_server_batch_handle_sequential_run(ctx);
   return;
 
 _aos_jrpc_server_batch_handle_sequential_err:
-  free(ctx);
   if (!args->out_response) {
     args->out_err = 1;
   }
   aos_resolve(future);
 }
 
+static void _aos_jrpc_server_batch_handle_sequential_run(
+    _aos_jrpc_server_batch_handle_sequential_ctx_t *ctx) {
+  while (ctx->item && !ctx->fail) {
+    cJSON *item = ctx->item;
+    ctx->item = item->next;
+
+    aos_future_config_t config = {
+        .cb = _aos_jrpc_server_batch_handle_sequential_cb, .ctx = ctx};
+    aos_future_t *item_future =
+        AOS_FUTURE_ALLOC_T(aos_jrpc_server_call_json)(&config, NULL, 0);
+    if (!item_future) {
+      ctx->fail = true;
+      break;
+    }
+    atomic_store(&ctx->state, _AOS_JRPC_SERVER_BATCH_DISPATCHING);
+    _aos_jrpc_server_request_handle(ctx->server, item, item_future, false,
+                                    ctx->arrival);
+
+    // Items don't reference the request after dispatching, drop owned ones
+    if (ctx->remainder) {
+      cJSON_Delete(cJSON_DetachItemViaPointer(ctx->remainder, item));
+    }
+
+    if (atomic_load(&ctx->state) == _AOS_JRPC_SERVER_BATCH_COMPLETED) {
+      continue;
+    }
+
+    // Item is still in progress and the caller's array may be gone once we
+    // return, copy what is left of it
+    if (!ctx->remainder && ctx->item) {
+      ctx->remainder = cJSON_CreateArray();
+      for (cJSON *next = ctx->item; ctx->remainder && next;
+           next = next->next) {
+        cJSON *next_dup = cJSON_Duplicate(next, true);
+        if (!cJSON_AddItemToArray(ctx->remainder, next_dup)) {
+          cJSON_Delete(next_dup);
+          cJSON_Delete(ctx->remainder);
+          ctx->remainder = NULL;
+        }
+      }
+      if (!ctx->remainder) {
+        ctx->fail = true; // Reported once the item in progress completes
+      }
+      ctx->item = ctx->remainder ? ctx->remainder->child : NULL;
+    }
+
+    // Hand over to the callback, unless the item completed meanwhile
+    unsigned int state = _AOS_JRPC_SERVER_BATCH_DISPATCHING;
+    if (atomic_compare_exchange_strong(&ctx->state, &state,
+                                       _AOS_JRPC_SERVER_BATCH_PENDING)) {
+      return;
+    }
+  }
+
+  // All items processed (or failed), resolve
+  aos_future_t *call_future = ctx->future;
+  AOS_ARGS_T(aos_jrpc_server_call_json) *call_args = aos_args_get(call_future);
+  if (ctx->fail) {
+    // Create an error response for the whole batch
+    cJSON_Delete(call_args->out_response);
+    call_args->out_response =
+        aos_jrpc_message_error(NULL, -32603, "Internal error");
+    if (!call_args->out_response) {
+      call_args->out_err = 1;
+    }
+  }
+  cJSON_Delete(ctx->remainder);
+  _aos_jrpc_server_freelist_put(ctx->server->batchctxs, ctx);
+  aos_resolve(call_future);
+}
+
 static void _aos_jrpc_server_batch_handle_sequential_cb(aos_future_t *future) {
   AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
   cJSON *out_response = args->out_response;
@@ -422,309 +2120,793 @@ static void _aos_jrpc_server_batch_handle_sequential_cb(aos_future_t *future) {
 
   // Disassemble ctx for convenience
   _aos_jrpc_server_batch_handle_sequential_ctx_t *ctx = aos_future_free(future);
-  aos_jrpc_server_t *server = ctx->server;
-  cJSON *request = ctx->request;
-  aos_future_t *call_future = ctx->future;
-
-  AOS_ARGS_T(aos_jrpc_server_call_json) *call_args = aos_args_get(call_future);
-  cJSON *err_response = NULL;
-
-  // Decrease counter
-  ctx->counter--;
+  AOS_ARGS_T(aos_jrpc_server_call_json) *call_args = aos_args_get(ctx->future);
 
   // Check if response processing was alright
   if (out_err) {
-    // Not alright, create an error response for the whole batch
-    err_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
-    goto _aos_jrpc_server_batch_handle_sequential_cb_err;
+    ctx->fail = true;
   }
 
   // Append response only if not a notification
-  if (out_response) {
+  if (out_response && !ctx->fail) {
     // Do we still need to allocate the response array?
     if (!call_args->out_response) {
       // This is the first single response we receive, allocate batch response
       // array
       call_args->out_response = cJSON_CreateArray();
-      if (!call_args->out_response) {
-        // Allocation failed, create an error response for the whole batch
-        err_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
-        goto _aos_jrpc_server_batch_handle_sequential_cb_err;
-      }
     }
 
-    // Add response (or error) to batch response array (only if not a
-    // notification)
-    if (!cJSON_AddItemToArray(call_args->out_response, out_response)) {
-      // Operation failed, create an error response for the whole batch
-      err_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
-      goto _aos_jrpc_server_batch_handle_sequential_cb_err;
+    // Add response (or error) to batch response array
+    if (cJSON_AddItemToArray(call_args->out_response, out_response)) {
+      out_response = NULL;
+    } else {
+      ctx->fail = true;
     }
   }
-
-  // Did we process all requests?
-  if (ctx->counter == 0) {
-    // Yes, free ctx then callback
-    cJSON_Delete(request);
-    free(ctx);
-    aos_resolve(call_future);
-    return;
-  }
-
-  // Some requests left, move on to the next one
-  aos_future_config_t config = {
-      .cb = _aos_jrpc_server_batch_handle_sequential_cb, .ctx = ctx};
-  aos_future_t *new_future =
-      AOS_FUTURE_ALLOC_T(aos_jrpc_server_call_json)(&config, NULL, 0);
-  if (!new_future) {
-    // Create an error response for the whole batch
-    err_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
-    goto _aos_jrpc_server_batch_handle_sequential_cb_err;
-  }
-  cJSON *item = cJSON_DetachItemFromArray(request, 0);
-  _aos_jrpc_server_request_handle(server, item, new_future);
-  cJSON_Delete(item);
-  return;
-
-_aos_jrpc_server_batch_handle_sequential_cb_err:
   cJSON_Delete(out_response);
-  free(ctx);
-  cJSON_Delete(
-      call_args->out_response); // Cleanup incomplete batch response if any
-  call_args->out_response = err_response;
-  if (!call_args->out_response) {
-    call_args->out_err = 1;
+
+  // Let the dispatcher carry on if it is still running, otherwise do it here
+  unsigned int state = _AOS_JRPC_SERVER_BATCH_DISPATCHING;
+  if (!atomic_compare_exchange_strong(&ctx->state, &state,
+                                      _AOS_JRPC_SERVER_BATCH_COMPLETED)) {
+    _aos_jrpc_server_batch_handle_sequential_run(ctx);
   }
-  aos_resolve(call_future);
 }
 
 /**
  * Parallel batch
  */
-typedef struct _aos_jrpc_server_batch_handle_parallel_ctx_t {
-  size_t counter;
+typedef struct _aos_jrpc_server_batch_handle_parallel_ctx_t
+    _aos_jrpc_server_batch_handle_parallel_ctx_t;
+typedef struct _aos_jrpc_server_batch_handle_parallel_slot_t {
+  _aos_jrpc_server_batch_handle_parallel_ctx_t *batch;
+  cJSON *response; // NULL for notifications
+} _aos_jrpc_server_batch_handle_parallel_slot_t;
+struct _aos_jrpc_server_batch_handle_parallel_ctx_t {
   aos_jrpc_server_t *server;
   aos_future_t *future;
-  SemaphoreHandle_t semaphore;
+  portMUX_TYPE lock;
+  cJSON *item;      // Next item to launch
+  cJSON *remainder; // Owned copy of the items not launched yet, if needed
+  int64_t arrival;  // Client deadlines of every item count from here
+  size_t count;
+  size_t window;
+  size_t launched;
+  size_t completed;
+  bool driving; // Someone is launching items
   bool fail;
-} _aos_jrpc_server_batch_handle_parallel_ctx_t;
+  _aos_jrpc_server_batch_handle_parallel_slot_t slots[];
+};
+static void _aos_jrpc_server_batch_handle_parallel_run(
+    _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx, bool caller);
+static void _aos_jrpc_server_batch_handle_parallel_done(
+    _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx);
+
 static void _aos_jrpc_server_batch_handle_parallel(aos_jrpc_server_t *server,
                                                    cJSON *request,
-                                                   aos_future_t *future) {
+                                                   aos_future_t *future,
+                                                   int64_t arrival) {
   AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
-  SemaphoreHandle_t semaphore = NULL;
-  _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx = NULL;
-  aos_future_t **parallel_futures = NULL;
 
   // Check for invalid arrays
-  if (!cJSON_GetArraySize(request)) {
+  size_t count = cJSON_GetArraySize(request);
+  if (!count) {
     args->out_response =
         aos_jrpc_message_error(NULL, -32600, "Invalid Request");
     goto _aos_jrpc_server_batch_handle_parallel_err;
   }
 
-  // Allocate ctx
-  ctx = calloc(1, sizeof(_aos_jrpc_server_batch_handle_parallel_ctx_t));
-  semaphore = xSemaphoreCreateRecursiveMutex();
-  if (!ctx || !semaphore) {
+  // Allocate ctx along with one result slot per item
+  _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx =
+      _aos_jrpc_server_freelist_get(
+          server->batchctxs, _aos_jrpc_server_batch_ctx_size(true, count));
+  if (!ctx) {
     args->out_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
     goto _aos_jrpc_server_batch_handle_parallel_err;
   }
-  ctx->semaphore = semaphore;
+  ctx->server = server;
   ctx->future = future;
-  ctx->counter = cJSON_GetArraySize(request);
-
-  // Allocate all futures beforehand in a temporary array, we don't want to
-  // launch operations if we're not sure we can start all of them
-  aos_future_config_t config = {.cb = _aos_jrpc_server_batch_handle_parallel_cb,
-                                .ctx = ctx};
-  parallel_futures =
-      calloc(cJSON_GetArraySize(request), sizeof(aos_future_t *));
-  if (!parallel_futures) {
-    args->out_response = aos_jrpc_message_error(NULL, -32603, "Internal error");
-    goto _aos_jrpc_server_batch_handle_parallel_err;
-  }
-  for (size_t i = 0; i < cJSON_GetArraySize(request); i++) {
-    parallel_futures[i] =
-        AOS_FUTURE_ALLOC_T(aos_jrpc_server_call_json)(&config, NULL, 0);
-    if (!parallel_futures[i]) {
-      args->out_response =
-          aos_jrpc_message_error(NULL, -32603, "Internal error");
-      goto _aos_jrpc_server_batch_handle_parallel_err;
-    }
+  portMUX_INITIALIZE(&ctx->lock);
+  ctx->item = request->child;
+  ctx->arrival = arrival;
+  ctx->count = count;
+  ctx->window = server->config.window ? server->config.window : count;
+  ctx->driving = true;
+  for (size_t i = 0; i < count; i++) {
+    ctx->slots[i].batch = ctx;
   }
 
-  // Launch futures
-  // NOTE: When the whole processing is single-threaded it is possible that the
-  // request gets freed during the last iteration (depends on the function
-  // handing the response). In such case the check after the last iteration will
-  // fail if we still rely on cJSON_GetArraySize. We thus use a separate
-  // variable.
-  unsigned int array_size = cJSON_GetArraySize(request);
-  for (size_t i = 0; i < array_size; i++) {
-    _aos_jrpc_server_request_handle(server, cJSON_GetArrayItem(request, i),
-                                    parallel_futures[i]);
-  }
-  free(parallel_futures);
+  _aos_jrpc_server_batch_handle_parallel_run(ctx, true);
   return;
 
 _aos_jrpc_server_batch_handle_parallel_err:
-  if (parallel_futures) {
-    for (size_t i = 0; i < cJSON_GetArraySize(request); i++) {
-      if (parallel_futures[i]) {
-        aos_future_free(parallel_futures[i]);
-      }
-    }
-  }
-  free(parallel_futures);
-  free(ctx);
-  if (semaphore) {
-    vSemaphoreDelete(semaphore);
-  }
   if (!args->out_response) {
     args->out_err = 1;
   }
   aos_resolve(future);
 }
 
+static void _aos_jrpc_server_batch_handle_parallel_run(
+    _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx, bool caller) {
+  // NOTE: Only one driver at a time, so the cursor and remainder are ours. The
+  // last completion frees ctx and the caller may free the request as soon as it
+  // has its response, ctx is thus released only once we stop driving.
+  taskENTER_CRITICAL(&ctx->lock);
+  while (true) {
+    // Launch the next item if the window allows it
+    if (ctx->launched < ctx->count &&
+        ctx->launched - ctx->completed < ctx->window) {
+      cJSON *item = ctx->item;
+      _aos_jrpc_server_batch_handle_parallel_slot_t *slot =
+          &ctx->slots[ctx->launched++];
+      ctx->item = item->next;
+      taskEXIT_CRITICAL(&ctx->lock);
+
+      aos_future_config_t config = {
+          .cb = _aos_jrpc_server_batch_handle_parallel_cb, .ctx = slot};
+      aos_future_t *item_future =
+          AOS_FUTURE_ALLOC_T(aos_jrpc_server_call_json)(&config, NULL, 0);
+      if (item_future) {
+        _aos_jrpc_server_request_handle(ctx->server, item, item_future, false,
+                                        ctx->arrival);
+      }
+
+      // Items don't reference the request after dispatching, drop owned ones
+      if (ctx->remainder) {
+        cJSON_Delete(cJSON_DetachItemViaPointer(ctx->remainder, item));
+      }
+
+      taskENTER_CRITICAL(&ctx->lock);
+      if (!item_future) {
+        ctx->fail = true;
+        ctx->completed++;
+      }
+      continue;
+    }
+
+    // Window is full and the caller's array may be gone once we return, copy
+    // what is left of it
+    if (caller && ctx->launched < ctx->count && !ctx->remainder) {
+      taskEXIT_CRITICAL(&ctx->lock);
+      ctx->remainder = cJSON_CreateArray();
+      for (cJSON *next = ctx->item; ctx->remainder && next;
+           next = next->next) {
+        cJSON *next_dup = cJSON_Duplicate(next, true);
+        if (!cJSON_AddItemToArray(ctx->remainder, next_dup)) {
+          cJSON_Delete(next_dup);
+          cJSON_Delete(ctx->remainder);
+          ctx->remainder = NULL;
+        }
+      }
+      ctx->item = ctx->remainder ? ctx->remainder->child : NULL;
+
+      taskENTER_CRITICAL(&ctx->lock);
+      if (!ctx->remainder) {
+        // Give up on the rest, reported once the items in flight complete
+        ctx->fail = true;
+        ctx->completed += ctx->count - ctx->launched;
+        ctx->launched = ctx->count;
+      }
+      continue;
+    }
+    break;
+  }
+  ctx->driving = false;
+  bool done = ctx->completed == ctx->count;
+  taskEXIT_CRITICAL(&ctx->lock);
+
+  if (done) {
+    _aos_jrpc_server_batch_handle_parallel_done(ctx);
+  }
+}
+
 static void _aos_jrpc_server_batch_handle_parallel_cb(aos_future_t *future) {
   AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
   cJSON *out_response = args->out_response;
   unsigned int out_err = args->out_err;
 
-  // Disassemble ctx pointers for convenience
-  _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx = aos_future_free(future);
-  aos_future_t *call_future = ctx->future;
+  // Each item owns its slot, no locking needed to fill it
+  _aos_jrpc_server_batch_handle_parallel_slot_t *slot = aos_future_free(future);
+  _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx = slot->batch;
+  slot->response = out_response;
 
+  // Launch the next item unless someone else is already doing it, the last
+  // item to complete assembles the response
+  taskENTER_CRITICAL(&ctx->lock);
+  if (out_err) {
+    ctx->fail = true;
+  }
+  ctx->completed++;
+  bool drive = !ctx->driving && ctx->launched < ctx->count;
+  bool done = !ctx->driving && ctx->completed == ctx->count;
+  ctx->driving = ctx->driving || drive;
+  taskEXIT_CRITICAL(&ctx->lock);
+
+  if (drive) {
+    _aos_jrpc_server_batch_handle_parallel_run(ctx, false);
+  } else if (done) {
+    _aos_jrpc_server_batch_handle_parallel_done(ctx);
+  }
+}
+
+static void _aos_jrpc_server_batch_handle_parallel_done(
+    _aos_jrpc_server_batch_handle_parallel_ctx_t *ctx) {
+  aos_future_t *call_future = ctx->future;
   AOS_ARGS_T(aos_jrpc_server_call_json) *call_args = aos_args_get(call_future);
+  bool fail = ctx->fail;
 
-  // Lock context to avoid race conditions
-  xSemaphoreTakeRecursive(ctx->semaphore, portMAX_DELAY);
+  // Assemble responses in request order, skipping notifications
+  for (size_t i = 0; i < ctx->count; i++) {
+    cJSON *response = ctx->slots[i].response;
+    if (!response) {
+      continue;
+    }
+    if (!fail && !call_args->out_response) {
+      call_args->out_response = cJSON_CreateArray();
+      fail = !call_args->out_response;
+    }
+    if (fail || !cJSON_AddItemToArray(call_args->out_response, response)) {
+      cJSON_Delete(response);
+      fail = true;
+    }
+  }
+  cJSON_Delete(ctx->remainder);
+  _aos_jrpc_server_freelist_put(ctx->server->batchctxs, ctx);
 
-  // Decrease counter
-  ctx->counter--;
+  if (fail) {
+    // Cleanup partial response, create an error response for the whole batch
+    cJSON_Delete(call_args->out_response);
+    call_args->out_response =
+        aos_jrpc_message_error(NULL, -32603, "Internal error");
+    if (!call_args->out_response) {
+      call_args->out_err = 1;
+    }
+  }
+  aos_resolve(call_future);
+}
 
-  // Check if response processing was alright or if we failed already
-  if (out_err || ctx->fail) {
-    // Context failed in previous iterations, don't do anything and wait for all
-    // other futures to complete.
-    cJSON_Delete(out_response);
-    ctx->fail = true;
-    goto _aos_jrpc_server_batch_handle_parallel_cb_end;
+static size_t _aos_jrpc_server_batch_ctx_size(bool parallel, size_t items) {
+  if (!parallel) {
+    return sizeof(_aos_jrpc_server_batch_handle_sequential_ctx_t);
   }
+  return sizeof(_aos_jrpc_server_batch_handle_parallel_ctx_t) +
+         items * sizeof(_aos_jrpc_server_batch_handle_parallel_slot_t);
+}
 
-  // If not a notification, add response to array
-  if (out_response) {
-    // Do we need to allocate the response array?
-    if (!call_args->out_response) {
-      // This is the first single response we receive, allocate batch response
-      // array
-      call_args->out_response = cJSON_CreateArray();
-      if (!call_args->out_response) {
-        // Allocation failed, set fail flag and cleanup
-        cJSON_Delete(out_response);
-        ctx->fail = true;
-        goto _aos_jrpc_server_batch_handle_parallel_cb_end;
-      }
+/**
+ * Context free lists
+ */
+static _aos_jrpc_server_freelist_t *
+_aos_jrpc_server_freelist_alloc(size_t size, size_t capacity) {
+  // Round objects up so that each of them is aligned
+  size = (size + alignof(max_align_t) - 1) / alignof(max_align_t) *
+         alignof(max_align_t);
+  _aos_jrpc_server_freelist_t *fl =
+      malloc(sizeof(_aos_jrpc_server_freelist_t) + capacity * size);
+  if (!fl) {
+    return NULL;
+  }
+  portMUX_INITIALIZE(&fl->lock);
+  fl->size = size;
+  fl->capacity = capacity;
+  fl->head = NULL;
+  atomic_init(&fl->refs, 1);
+  atomic_init(&fl->hits, 0);
+  atomic_init(&fl->misses, 0);
+  for (size_t i = capacity; i > 0; i--) {
+    void **obj = (void **)&fl->objects[(i - 1) * size];
+    *obj = fl->head;
+    fl->head = obj;
+  }
+  return fl;
+}
+
+static void _aos_jrpc_server_freelist_release(_aos_jrpc_server_freelist_t *fl) {
+  if (atomic_fetch_sub(&fl->refs, 1) == 1) {
+    free(fl);
+  }
+}
+
+static void *_aos_jrpc_server_freelist_get(_aos_jrpc_server_freelist_t *fl,
+                                           size_t size) {
+  void **obj = NULL;
+  if (size <= fl->size) {
+    taskENTER_CRITICAL(&fl->lock);
+    obj = fl->head;
+    if (obj) {
+      fl->head = *obj;
     }
+    taskEXIT_CRITICAL(&fl->lock);
+  }
 
-    // Add response (or error) to batch response array
-    if (!cJSON_AddItemToArray(call_args->out_response, out_response)) {
-      // Operation failed,
-      ctx->fail = true;
-      cJSON_Delete(out_response);
-      goto _aos_jrpc_server_batch_handle_parallel_cb_end;
-    }
-  }
-
-// Are we done?
-_aos_jrpc_server_batch_handle_parallel_cb_end:
-  if (ctx->counter == 0) {
-    // Did context fail?
-    if (ctx->fail) {
-      // Cleanup partial response, return a failure
-      vSemaphoreDelete(ctx->semaphore);
-      free(ctx);
-      cJSON_Delete(call_args->out_response);
-      call_args->out_response = NULL;
-      // Create an error response for the whole batch
-      call_args->out_response =
-          aos_jrpc_message_error(NULL, -32603, "Internal error");
-      if (!call_args->out_response) {
-        call_args->out_err = 1;
-      }
-      aos_resolve(call_future);
-      return;
+  if (obj) {
+    atomic_fetch_add(&fl->hits, 1);
+    memset(obj, 0, size);
+  } else {
+    // Objects are never smaller than cached ones, callers may use the room
+    atomic_fetch_add(&fl->misses, 1);
+    obj = calloc(1, size > fl->size ? size : fl->size);
+    if (!obj) {
+      return NULL;
     }
-    // All good, complete processing
-    vSemaphoreDelete(ctx->semaphore);
-    free(ctx);
-    aos_resolve(call_future);
-    return;
   }
+  atomic_fetch_add(&fl->refs, 1);
+  return obj;
+}
 
-  // Nope, give back semaphore
-  xSemaphoreGiveRecursive(ctx->semaphore);
+static void _aos_jrpc_server_freelist_put(_aos_jrpc_server_freelist_t *fl,
+                                          void *obj) {
+  unsigned char *byte = obj;
+  if (byte >= fl->objects && byte < &fl->objects[fl->capacity * fl->size]) {
+    taskENTER_CRITICAL(&fl->lock);
+    *(void **)obj = fl->head;
+    fl->head = obj;
+    taskEXIT_CRITICAL(&fl->lock);
+  } else {
+    free(obj);
+  }
+  _aos_jrpc_server_freelist_release(fl);
 }
 
 /**
  * Handler get/set/unset
  */
-static aos_jrpc_server_handler_t
-_aos_jrpc_server_handler_get(aos_jrpc_server_t *server, const char *method) {
-  for (_aos_jrpc_server_handler_entry_t *entry = server->handlers; entry;
-       entry = entry->next) {
-    if (!strcmp(entry->method, method)) {
-      return entry->handler;
+static uint32_t _aos_jrpc_server_hash(const char *str, size_t *len) {
+  // FNV-1a, computing the string length in the same pass
+  uint32_t hash = 2166136261u;
+  const char *c = str;
+  for (; *c; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619u;
+  }
+  *len = c - str;
+  return hash;
+}
+
+static uint32_t _aos_jrpc_server_hash_mix(uint32_t hash, uint32_t seed) {
+  // Murmur3 finalizer over the seeded hash
+  hash ^= seed * 0x9e3779b9u;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/**
+ * Registry readers announce themselves in the counter matching the current
+ * epoch parity. Writers flip the epoch after publishing and wait for the
+ * previous parity to drain before reclaiming. Readers never wait, and writers
+ * only wait for readers that may still hold the old table.
+ */
+static unsigned int _aos_jrpc_server_read_lock(aos_jrpc_server_t *server) {
+  for (;;) {
+    unsigned int epoch = atomic_load(&server->epoch);
+    atomic_fetch_add(&server->readers[epoch & 1], 1);
+    if (atomic_load(&server->epoch) == epoch) {
+      return epoch;
+    }
+    // A writer flipped the epoch meanwhile, retry with the new parity
+    atomic_fetch_sub(&server->readers[epoch & 1], 1);
+  }
+}
+
+static void _aos_jrpc_server_read_unlock(aos_jrpc_server_t *server,
+                                         unsigned int epoch) {
+  atomic_fetch_sub(&server->readers[epoch & 1], 1);
+}
+
+static void _aos_jrpc_server_synchronize(aos_jrpc_server_t *server) {
+  unsigned int epoch = atomic_fetch_add(&server->epoch, 1);
+  while (atomic_load(&server->readers[epoch & 1])) {
+    vTaskDelay(1);
+  }
+}
+
+static _aos_jrpc_server_handler_entry_t *
+_aos_jrpc_server_handler_table_find(_aos_jrpc_server_handler_table_t *table,
+                                    uint32_t hash, size_t len,
+                                    const char *method) {
+  if (!table) {
+    return NULL;
+  }
+  size_t mask = table->capacity - 1;
+  for (size_t slot = hash & mask; table->entries[slot].method;
+       slot = (slot + 1) & mask) {
+    _aos_jrpc_server_handler_entry_t *entry = &table->entries[slot];
+    if (entry->hash == hash && entry->len == len &&
+        !memcmp(entry->method, method, len)) {
+      return entry;
     }
   }
   return NULL;
 }
 
+static _aos_jrpc_server_handler_table_t *
+_aos_jrpc_server_handler_table_copy(_aos_jrpc_server_handler_table_t *table,
+                                    size_t capacity,
+                                    _aos_jrpc_server_handler_entry_t *skip) {
+  _aos_jrpc_server_handler_table_t *copy =
+      calloc(1, sizeof(_aos_jrpc_server_handler_table_t) +
+                    capacity * sizeof(_aos_jrpc_server_handler_entry_t));
+  if (!copy) {
+    return NULL;
+  }
+  copy->capacity = capacity;
+
+  // Rehash entries in the copy, method strings are shared
+  for (size_t i = 0; table && i < table->capacity; i++) {
+    _aos_jrpc_server_handler_entry_t *entry = &table->entries[i];
+    if (!entry->method || entry == skip) {
+      continue;
+    }
+    size_t slot = entry->hash & (capacity - 1);
+    while (copy->entries[slot].method) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    copy->entries[slot] = *entry;
+    copy->count++;
+  }
+  return copy;
+}
+
+static _aos_jrpc_server_handler_get_t
+_aos_jrpc_server_handler_get(aos_jrpc_server_t *server, const char *method,
+                             aos_jrpc_server_handler_config_t *config,
+                             _aos_jrpc_server_handler_limit_t **limit) {
+  size_t len = 0;
+  uint32_t hash = _aos_jrpc_server_hash(method, &len);
+
+  // Frozen registry, a single candidate slot and no reclamation to care about
+  _aos_jrpc_server_handler_frozen_t *frozen = atomic_load(&server->frozen);
+  if (frozen) {
+    if (!frozen->count) {
+      return _AOS_JRPC_SERVER_HANDLER_MISSING;
+    }
+    uint32_t seed = frozen->seeds[hash % frozen->count];
+    _aos_jrpc_server_handler_entry_t *entry =
+        &frozen->entries[_aos_jrpc_server_hash_mix(hash, seed) %
+                         frozen->count];
+    for (size_t i = frozen->count;
+         entry->hash != hash || entry->len != len ||
+         memcmp(entry->method, method, len);
+         i++) {
+      if (i == frozen->count + frozen->overflow) {
+        return _AOS_JRPC_SERVER_HANDLER_MISSING;
+      }
+      entry = &frozen->entries[i]; // Colliding hash, rare
+    }
+    if (!_aos_jrpc_server_handler_limit_acquire(entry, limit)) {
+      return _AOS_JRPC_SERVER_HANDLER_LIMITED;
+    }
+    *config = entry->config;
+    return _AOS_JRPC_SERVER_HANDLER_FOUND;
+  }
+
+  _aos_jrpc_server_handler_get_t outcome = _AOS_JRPC_SERVER_HANDLER_MISSING;
+  unsigned int epoch = _aos_jrpc_server_read_lock(server);
+  _aos_jrpc_server_handler_entry_t *entry = _aos_jrpc_server_handler_table_find(
+      atomic_load(&server->handlers), hash, len, method);
+  if (entry && !_aos_jrpc_server_handler_limit_acquire(entry, limit)) {
+    outcome = _AOS_JRPC_SERVER_HANDLER_LIMITED;
+  } else if (entry) {
+    *config = entry->config; // Copy out, the table may go once unlocked
+    outcome = _AOS_JRPC_SERVER_HANDLER_FOUND;
+  }
+  _aos_jrpc_server_read_unlock(server, epoch);
+  return outcome;
+}
+
 unsigned int aos_jrpc_server_handler_set(aos_jrpc_server_t *server,
                                          aos_jrpc_server_handler_t handler,
                                          const char *method) {
-  xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
-  _aos_jrpc_server_handler_entry_t **entry = &server->handlers;
-  while (*entry) {
-    if (!strcmp((*entry)->method, method)) {
-      (*entry)->handler = handler;
-      xSemaphoreGiveRecursive(server->semaphore);
-      return 0;
+  aos_jrpc_server_handler_config_t config = {.handler = handler};
+  return aos_jrpc_server_handler_register(server, method, &config);
+}
+
+unsigned int aos_jrpc_server_handler_register(
+    aos_jrpc_server_t *server, const char *method,
+    const aos_jrpc_server_handler_config_t *config) {
+  size_t len = 0;
+  uint32_t hash = _aos_jrpc_server_hash(method, &len);
+  char *handler_method = NULL;
+  _aos_jrpc_server_handler_limit_t *limit = NULL;
+  _aos_jrpc_server_handler_limit_t *old_limit = NULL;
+
+  // Descriptors must fit the struct they bind into
+  if (!_aos_jrpc_server_params_check(config)) {
+    return 1;
+  }
+
+  // Limits state starts afresh on every registration
+  if (config->maxconcurrent || config->rate) {
+    limit = _aos_jrpc_server_handler_limit_alloc(config);
+    if (!limit) {
+      return 1;
     }
-    entry = &(*entry)->next;
   }
-  *entry = calloc(1, sizeof(_aos_jrpc_server_handler_entry_t));
-  char *handler_method = strdup(method);
-  if (!*entry || !handler_method) {
-    free(*entry);
-    *entry = NULL;
-    free(handler_method);
-    xSemaphoreGiveRecursive(server->semaphore);
-    return 1;
+
+  xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
+  if (atomic_load(&server->frozen) ||
+      (config->timeout && !_aos_jrpc_server_reaper_start(server))) {
+    goto aos_jrpc_server_handler_register_err;
+  }
+  _aos_jrpc_server_handler_table_t *table = atomic_load(&server->handlers);
+  _aos_jrpc_server_handler_table_t *copy = NULL;
+  _aos_jrpc_server_handler_entry_t *entry =
+      _aos_jrpc_server_handler_table_find(table, hash, len, method);
+  if (entry) {
+    // Replace handler of an already registered method
+    copy = _aos_jrpc_server_handler_table_copy(table, table->capacity, NULL);
+    if (!copy) {
+      goto aos_jrpc_server_handler_register_err;
+    }
+    entry = _aos_jrpc_server_handler_table_find(copy, hash, len, method);
+    old_limit = entry->limit;
+    entry->config = *config;
+    entry->limit = limit;
+  } else {
+    // Add method, growing the table to keep load factor below 3/4
+    size_t count = table ? table->count : 0;
+    size_t capacity =
+        table ? table->capacity : _AOS_JRPC_SERVER_HANDLER_TABLE_MINCAPACITY;
+    while ((count + 1) * 4 > capacity * 3) {
+      capacity *= 2;
+    }
+    handler_method = strdup(method);
+    copy = _aos_jrpc_server_handler_table_copy(table, capacity, NULL);
+    if (!handler_method || !copy) {
+      free(copy);
+      goto aos_jrpc_server_handler_register_err;
+    }
+    size_t slot = hash & (capacity - 1);
+    while (copy->entries[slot].method) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    copy->entries[slot] =
+        (_aos_jrpc_server_handler_entry_t){.hash = hash,
+                                           .len = len,
+                                           .method = handler_method,
+                                           .config = *config,
+                                           .limit = limit};
+    copy->count++;
   }
-  (*entry)->method = handler_method;
-  (*entry)->handler = handler;
+
+  // Publish, then reclaim the old table once readers moved on
+  atomic_store(&server->handlers, copy);
+  _aos_jrpc_server_synchronize(server);
   xSemaphoreGiveRecursive(server->semaphore);
+  _aos_jrpc_server_handler_limit_unref(old_limit);
+  free(table);
   return 0;
+
+aos_jrpc_server_handler_register_err:
+  xSemaphoreGiveRecursive(server->semaphore);
+  _aos_jrpc_server_handler_limit_unref(limit);
+  free(handler_method);
+  return 1;
 }
 
 unsigned int aos_jrpc_server_handler_unset(aos_jrpc_server_t *server,
                                            const char *method) {
+  size_t len = 0;
+  uint32_t hash = _aos_jrpc_server_hash(method, &len);
+
   xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
-  _aos_jrpc_server_handler_entry_t **entry = &server->handlers;
-  while (*entry) {
-    if (!strcmp((*entry)->method, method)) {
-      _aos_jrpc_server_handler_entry_t *entry_next = (*entry)->next;
-      free((*entry)->method);
-      free((*entry));
-      *entry = entry_next;
+  _aos_jrpc_server_handler_table_t *table = atomic_load(&server->handlers);
+  _aos_jrpc_server_handler_entry_t *entry =
+      _aos_jrpc_server_handler_table_find(table, hash, len, method);
+  if (atomic_load(&server->frozen) || !entry) {
+    xSemaphoreGiveRecursive(server->semaphore);
+    return 1;
+  }
+
+  // Copy without the method, shrinking the table when it gets sparse
+  _aos_jrpc_server_handler_table_t *copy = NULL;
+  if (table->count > 1) {
+    size_t capacity = table->capacity;
+    while (capacity > _AOS_JRPC_SERVER_HANDLER_TABLE_MINCAPACITY &&
+           (table->count - 1) * 8 < capacity) {
+      capacity /= 2;
+    }
+    copy = _aos_jrpc_server_handler_table_copy(table, capacity, entry);
+    if (!copy) {
       xSemaphoreGiveRecursive(server->semaphore);
-      return 0;
+      return 1;
     }
-    entry = &(*entry)->next;
   }
+
+  // Publish, then reclaim the old table and method once readers moved on
+  atomic_store(&server->handlers, copy);
+  _aos_jrpc_server_synchronize(server);
   xSemaphoreGiveRecursive(server->semaphore);
+  _aos_jrpc_server_handler_limit_unref(entry->limit);
+  free(entry->method);
+  free(table);
+  return 0;
+}
+
+typedef struct _aos_jrpc_server_handler_freeze_key_t {
+  uint32_t bucket;
+  uint32_t size; // Number of keys sharing the bucket
+  _aos_jrpc_server_handler_entry_t *entry;
+} _aos_jrpc_server_handler_freeze_key_t;
+
+static int _aos_jrpc_server_handler_freeze_hash_cmp(const void *a,
+                                                   const void *b) {
+  const _aos_jrpc_server_handler_freeze_key_t *key_a = a;
+  const _aos_jrpc_server_handler_freeze_key_t *key_b = b;
+  // Equal hashes next to each other
+  if (key_a->entry->hash != key_b->entry->hash) {
+    return key_a->entry->hash < key_b->entry->hash ? -1 : 1;
+  }
+  return 0;
+}
+
+static int _aos_jrpc_server_handler_freeze_cmp(const void *a, const void *b) {
+  const _aos_jrpc_server_handler_freeze_key_t *key_a = a;
+  const _aos_jrpc_server_handler_freeze_key_t *key_b = b;
+  // Largest buckets first, keys of the same bucket next to each other
+  if (key_a->size != key_b->size) {
+    return key_a->size < key_b->size ? 1 : -1;
+  }
+  if (key_a->bucket != key_b->bucket) {
+    return key_a->bucket < key_b->bucket ? -1 : 1;
+  }
+  return 0;
+}
+
+unsigned int aos_jrpc_server_handlers_freeze(aos_jrpc_server_t *server) {
+  _aos_jrpc_server_handler_table_t *table = NULL;
+  _aos_jrpc_server_handler_freeze_key_t *keys = NULL;
+  uint32_t *sizes = NULL;
+  uint32_t *slots = NULL;
+  bool *taken = NULL;
+  _aos_jrpc_server_handler_frozen_t *frozen = NULL;
+
+  xSemaphoreTakeRecursive(server->semaphore, portMAX_DELAY);
+  if (atomic_load(&server->frozen)) {
+    goto aos_jrpc_server_handlers_freeze_err;
+  }
+  table = atomic_load(&server->handlers);
+
+  // Methods sharing their full hash with an earlier one go past the table
+  size_t total = table ? table->count : 0;
+  size_t methods_size = 0;
+  keys = calloc(total, sizeof(_aos_jrpc_server_handler_freeze_key_t));
+  if (total && !keys) {
+    goto aos_jrpc_server_handlers_freeze_err;
+  }
+  size_t key_count = 0;
+  for (size_t i = 0; table && i < table->capacity; i++) {
+    if (table->entries[i].method) {
+      methods_size += table->entries[i].len + 1;
+      keys[key_count++].entry = &table->entries[i];
+    }
+  }
+  if (total) {
+    qsort(keys, total, sizeof(_aos_jrpc_server_handler_freeze_key_t),
+          _aos_jrpc_server_handler_freeze_hash_cmp);
+  }
+  size_t overflow = 0;
+  for (size_t i = 1; i < total; i++) {
+    overflow += keys[i].entry->hash == keys[i - 1].entry->hash;
+  }
+  size_t count = total - overflow;
+
+  // Allocate the table in one block: header, seeds, entries, methods
+  size_t seeds_offset = sizeof(_aos_jrpc_server_handler_frozen_t);
+  size_t entries_offset =
+      seeds_offset + count * sizeof(uint32_t) +
+      (-(count * sizeof(uint32_t)) & (sizeof(void *) - 1));
+  size_t methods_offset =
+      entries_offset + total * sizeof(_aos_jrpc_server_handler_entry_t);
+  frozen = calloc(1, methods_offset + methods_size);
+  sizes = calloc(count, sizeof(uint32_t));
+  slots = calloc(count, sizeof(uint32_t));
+  taken = calloc(count, sizeof(bool));
+  if (!frozen || (count && (!sizes || !slots || !taken))) {
+    goto aos_jrpc_server_handlers_freeze_err;
+  }
+  frozen->count = count;
+  frozen->overflow = overflow;
+  frozen->seeds = (uint32_t *)((char *)frozen + seeds_offset);
+  frozen->entries =
+      (_aos_jrpc_server_handler_entry_t *)((char *)frozen + entries_offset);
+  char *methods = (char *)frozen + methods_offset;
+
+  // Copy colliding methods past the table, keep the others as keys
+  key_count = 0;
+  for (size_t i = 0; i < total; i++) {
+    _aos_jrpc_server_handler_entry_t *entry = keys[i].entry;
+    if (!key_count || entry->hash != keys[key_count - 1].entry->hash) {
+      keys[key_count++].entry = entry;
+      continue;
+    }
+    _aos_jrpc_server_handler_entry_t *slot =
+        &frozen->entries[count + i - key_count];
+    *slot = *entry;
+    slot->method = methods;
+    memcpy(methods, entry->method, entry->len + 1);
+    methods += entry->len + 1;
+  }
+
+  // Group keys by bucket, biggest buckets are placed first while the table is
+  // still mostly empty
+  for (size_t i = 0; i < count; i++) {
+    keys[i].bucket = keys[i].entry->hash % count;
+    sizes[keys[i].bucket]++;
+  }
+  for (size_t i = 0; i < count; i++) {
+    keys[i].size = sizes[keys[i].bucket];
+  }
+  if (count) {
+    qsort(keys, count, sizeof(_aos_jrpc_server_handler_freeze_key_t),
+          _aos_jrpc_server_handler_freeze_cmp);
+  }
+
+  // Find a seed for each bucket mapping all of its keys to free slots
+  for (size_t first = 0; first < count; first += keys[first].size) {
+    size_t size = keys[first].size;
+    uint32_t seed = 0;
+    for (;; seed++) {
+      if (seed > 64 * count + 1024) {
+        // Distinct hashes that keep mixing into the same slots, give up
+        goto aos_jrpc_server_handlers_freeze_err;
+      }
+      size_t placed = 0;
+      for (; placed < size; placed++) {
+        uint32_t slot = _aos_jrpc_server_hash_mix(
+                            keys[first + placed].entry->hash, seed) %
+                        count;
+        if (taken[slot]) {
+          break;
+        }
+        taken[slot] = true;
+        slots[placed] = slot;
+      }
+      if (placed == size) {
+        break;
+      }
+      // Collision, release the slots taken by this attempt
+      while (placed--) {
+        taken[slots[placed]] = false;
+      }
+    }
+    frozen->seeds[keys[first].bucket] = seed;
+    for (size_t i = 0; i < size; i++) {
+      _aos_jrpc_server_handler_entry_t *entry = keys[first + i].entry;
+      frozen->entries[slots[i]] = *entry;
+      frozen->entries[slots[i]].method = methods;
+      memcpy(methods, entry->method, entry->len + 1);
+      methods += entry->len + 1;
+    }
+  }
+
+  // Swap registries, then reclaim the mutable one once readers moved on. Limits
+  // are handed over to the frozen registry.
+  atomic_store(&server->frozen, frozen);
+  atomic_store(&server->handlers, NULL);
+  _aos_jrpc_server_synchronize(server);
+  xSemaphoreGiveRecursive(server->semaphore);
+  for (size_t i = 0; table && i < table->capacity; i++) {
+    free(table->entries[i].method);
+  }
+  free(table);
+  free(keys);
+  free(sizes);
+  free(slots);
+  free(taken);
+  return 0;
+
+aos_jrpc_server_handlers_freeze_err:
+  xSemaphoreGiveRecursive(server->semaphore);
+  free(frozen);
+  free(keys);
+  free(sizes);
+  free(slots);
+  free(taken);
   return 1;
 }
 
@@ -743,6 +2925,209 @@ static bool _aos_jrpc_server_isvalid(cJSON *request) {
   return true;
 }
 
+/**
+ * Param binding
+ */
+static bool
+_aos_jrpc_server_params_check(const aos_jrpc_server_handler_config_t *config) {
+  if (!config->nparams) {
+    return true;
+  }
+  if (!config->params || config->nparams > _AOS_JRPC_SERVER_PARAMS_MAX) {
+    return false;
+  }
+  for (size_t i = 0; i < config->nparams; i++) {
+    const aos_jrpc_server_param_t *param = &config->params[i];
+    if (param->type >= AOS_JRPC_SERVER_PARAM_TYPES ||
+        param->offset > config->paramsize ||
+        _aos_jrpc_server_param_types[param->type].size >
+            config->paramsize - param->offset) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool
+_aos_jrpc_server_params_bind(const aos_jrpc_server_handler_config_t *config,
+                             cJSON *params, void *bound) {
+  uint32_t seen = 0;
+  if (cJSON_IsArray(params)) {
+    // Items bind to descriptors in order
+    size_t i = 0;
+    for (cJSON *item = params->child; item; item = item->next, i++) {
+      if (i == config->nparams ||
+          !_aos_jrpc_server_param_bind(&config->params[i], item, bound)) {
+        return false;
+      }
+      seen |= 1u << i;
+    }
+  } else if (cJSON_IsObject(params)) {
+    // Members usually come in descriptor order, so name lookups resume after
+    // the last match and take a single comparison
+    size_t next = 0;
+    for (cJSON *item = params->child; item; item = item->next) {
+      size_t i = next;
+      size_t tries = 0;
+      while (!config->params[i].name ||
+             strcmp(config->params[i].name, item->string)) {
+        if (++tries == config->nparams) {
+          return false; // Unknown member
+        }
+        i = (i + 1) % config->nparams;
+      }
+      if ((seen & (1u << i)) ||
+          !_aos_jrpc_server_param_bind(&config->params[i], item, bound)) {
+        return false;
+      }
+      seen |= 1u << i;
+      next = (i + 1) % config->nparams;
+    }
+  } else if (params) {
+    return false;
+  }
+
+  // Required parameters must all be there
+  for (size_t i = 0; i < config->nparams; i++) {
+    if (!(seen & (1u << i)) && !config->params[i].optional) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool _aos_jrpc_server_param_bind(const aos_jrpc_server_param_t *param,
+                                        cJSON *json, void *bound) {
+  void *member = (char *)bound + param->offset;
+  double value = json->valuedouble; // Checked against bounds, or length
+  switch (param->type) {
+  case AOS_JRPC_SERVER_PARAM_STR:
+    if (!cJSON_IsString(json)) {
+      return false;
+    }
+    value = strlen(json->valuestring);
+    *(char **)member = json->valuestring;
+    break;
+  case AOS_JRPC_SERVER_PARAM_BOOL:
+    if (!cJSON_IsBool(json)) {
+      return false;
+    }
+    *(bool *)member = cJSON_IsTrue(json);
+    return true;
+  case AOS_JRPC_SERVER_PARAM_ARRAY:
+  case AOS_JRPC_SERVER_PARAM_OBJECT:
+    if (param->type == AOS_JRPC_SERVER_PARAM_ARRAY ? !cJSON_IsArray(json)
+                                                   : !cJSON_IsObject(json)) {
+      return false;
+    }
+    value = cJSON_GetArraySize(json);
+    *(cJSON **)member = json;
+    break;
+  default:
+    // Numbers, NaN never gets in range. Integers are not truncated.
+    if (!cJSON_IsNumber(json) ||
+        !(value >= _aos_jrpc_server_param_types[param->type].min &&
+          value <= _aos_jrpc_server_param_types[param->type].max) ||
+        (_aos_jrpc_server_param_types[param->type].integral &&
+         value != trunc(value))) {
+      return false;
+    }
+    switch (param->type) {
+    case AOS_JRPC_SERVER_PARAM_UINT8:
+      *(uint8_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_UINT16:
+      *(uint16_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_UINT32:
+      *(uint32_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_UINT64:
+      *(uint64_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_INT8:
+      *(int8_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_INT16:
+      *(int16_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_INT32:
+      *(int32_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_INT64:
+      *(int64_t *)member = value;
+      break;
+    case AOS_JRPC_SERVER_PARAM_FLOAT:
+      *(float *)member = value;
+      break;
+    default:
+      *(double *)member = value;
+      break;
+    }
+    break;
+  }
+
+  // Descriptor bounds
+  if (param->min < param->max &&
+      !(value >= param->min && value <= param->max)) {
+    return false;
+  }
+  return true;
+}
+
+static bool
+_aos_jrpc_server_params_detach(const aos_jrpc_server_handler_config_t *config,
+                               _aos_jrpc_server_request_handle_ctx_t *ctx,
+                               size_t room) {
+  // Strings go after the bound struct if they fit, in a single block otherwise
+  size_t len = 0;
+  for (size_t i = 0; i < config->nparams; i++) {
+    char **member = (char **)((char *)ctx->bound + config->params[i].offset);
+    if (config->params[i].type == AOS_JRPC_SERVER_PARAM_STR && *member) {
+      len += strlen(*member) + 1;
+    }
+  }
+  char *strings = (char *)ctx->bound + config->paramsize;
+  if (len > room) {
+    strings = ctx->strings = malloc(len);
+    if (!strings) {
+      return false;
+    }
+  }
+
+  // Arrays and objects are copied alone, kept together for freeing
+  for (size_t i = 0; i < config->nparams; i++) {
+    void *member = (char *)ctx->bound + config->params[i].offset;
+    switch (config->params[i].type) {
+    case AOS_JRPC_SERVER_PARAM_STR:
+      if (*(char **)member) {
+        size_t size = strlen(*(char **)member) + 1;
+        memcpy(strings, *(char **)member, size);
+        *(char **)member = strings;
+        strings += size;
+      }
+      break;
+    case AOS_JRPC_SERVER_PARAM_ARRAY:
+    case AOS_JRPC_SERVER_PARAM_OBJECT:
+      if (*(cJSON **)member) {
+        if (!ctx->params && !(ctx->params = cJSON_CreateArray())) {
+          return false;
+        }
+        cJSON *copy = cJSON_Duplicate(*(cJSON **)member, true);
+        if (!copy) {
+          return false;
+        }
+        cJSON_AddItemToArray(ctx->params, copy);
+        *(cJSON **)member = copy;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return true;
+}
+
 /**
  * Param getters
  */
@@ -12,5 +12,8 @@ void test_handler1(cJSON *params, aos_future_t *future);
 AOS_DECLARE(test_handler_delayed)
 void test_handler_delayed(cJSON *params, aos_future_t *future);
 
+void test_handler_deferred(cJSON *params, aos_future_t *future);
+void test_handler_deferred_resolve();
+
 AOS_DECLARE(test_handler_async)
 void test_handler_async(cJSON *params, aos_future_t *future);
\ No newline at end of file
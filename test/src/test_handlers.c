@@ -35,6 +35,20 @@ void test_handler_delayed(cJSON *params, aos_future_t *future) {
   aos_resolve(future);
 }
 
+static aos_future_t *test_handler_deferred_future = NULL;
+void test_handler_deferred(cJSON *params, aos_future_t *future) {
+  test_handler_deferred_future = future;
+}
+
+void test_handler_deferred_resolve() {
+  aos_future_t *future = test_handler_deferred_future;
+  TEST_ASSERT_NOT_NULL(future);
+  test_handler_deferred_future = NULL;
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  args->out_result = cJSON_Parse("0");
+  aos_resolve(future);
+}
+
 AOS_DEFINE(test_handler_async)
 static void test_handler_async_cb(aos_future_t *future);
 void test_handler_async(cJSON *params, aos_future_t *future) {
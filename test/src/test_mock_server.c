@@ -30,8 +30,15 @@ void test_mock_server_init(void (*on_output)(const char *data)) {
 }
 
 void test_mock_server_deinit() {
-  vTaskDelay(pdMS_TO_TICKS(
-      500)); // Wait for an eventual incomplete testHandlerDelayed.
+  // Wait for an eventual incomplete testHandlerDelayed
+  aos_future_t *future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_shutdown)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_jrpc_server_shutdown(_server, future);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  AOS_ARGS_T(aos_jrpc_server_shutdown) *args = aos_args_get(future);
+  TEST_ASSERT_EQUAL(0, args->out_err);
+  aos_awaitable_free(future);
   aos_jrpc_server_free(_server);
   _server = NULL;
 }
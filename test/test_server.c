@@ -1,10 +1,13 @@
-/**
- * TODO:
- * - Test request limiter, and counter reeentrancy
- */
+#include <aos_jrpc_message.h>
 #include <aos_jrpc_server.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
 #include <test_handlers.h>
 #include <test_macros.h>
 #include <unity.h>
@@ -78,13 +81,13 @@
 // Should return both responses
 #define STRING_BATCH_VALID0                                                    \
   "[" STRING_REQUEST_HANDLER0_VALID0 "," STRING_REQUEST_HANDLER1_VALID0        \
-  "]" // NOTE: This should fail once we have implemented id checking among
-      // active requests
+  "]" // NOTE: IDs are only checked among active requests, the first request
+      // completes before the second one starts
 // Should return both responses
 #define STRING_BATCH_VALID1                                                    \
   "[" STRING_REQUEST_HANDLER0_VALID0 "," STRING_REQUEST_HANDLER0_VALID0        \
-  "]" // NOTE: This should fail once we have implemented id checking among
-      // active requests
+  "]" // NOTE: IDs are only checked among active requests, the first request
+      // completes before the second one starts
 // Should return one valid response and an error response
 #define STRING_BATCH_VALID2                                                    \
   "[" STRING_REQUEST_HANDLER0_VALID0                                           \
@@ -101,6 +104,20 @@
 // Should return three error responses in an array
 #define STRING_BATCH_INVALID1 "[1,2,3]"
 
+AOS_DECLARE(test_call_loop, aos_jrpc_server_t *in_server,
+            const char *in_request, size_t in_iterations,
+            size_t out_rejected)
+static void test_call_loop(aos_future_t *future);
+AOS_DECLARE(test_call_json_spawnable, aos_jrpc_server_t *in_server,
+            cJSON *in_request, cJSON *out_response, unsigned int out_err)
+static void test_call_json_spawnable(aos_future_t *future);
+AOS_DECLARE(test_call_churn, aos_jrpc_server_t *in_server, size_t in_iterations,
+            size_t out_found, size_t out_missing, size_t out_torn)
+static void test_call_churn(aos_future_t *future);
+AOS_DECLARE(test_set_churn, aos_jrpc_server_t *in_server, size_t in_iterations,
+            size_t out_failed)
+static void test_set_churn(aos_future_t *future);
+
 static void test_call(aos_jrpc_server_t *server, const char *data) {
   printf("Request: %s\n", data);
 
@@ -156,6 +173,39 @@ static void test_call_json(aos_jrpc_server_t *server, const char *data) {
   return;
 }
 
+/**
+ * @brief Start a call, its future is checked with test_call_check
+ */
+static aos_future_t *test_call_start(aos_jrpc_server_t *server,
+                                     const char *data) {
+  aos_future_t *future = AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_jrpc_server_call(server, data, future);
+  return future;
+}
+
+/**
+ * @brief Await a call and check whether its response holds a needle, then free
+ * it. Without a needle the response is neither checked nor printed, for loops.
+ */
+static void test_call_check(aos_future_t *future, const char *needle,
+                            bool found) {
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
+  TEST_ASSERT_NOT_NULL(args->out_data);
+  if (needle) {
+    printf("Response: %s\n", args->out_data);
+    TEST_ASSERT_EQUAL(found, strstr(args->out_data, needle) != NULL);
+  }
+  free(args->out_data);
+  aos_awaitable_free(future);
+}
+
+static void test_call_find(aos_jrpc_server_t *server, const char *data,
+                           const char *needle, bool found) {
+  test_call_check(test_call_start(server, data), needle, found);
+}
+
 TEST_CASE("Alloc/Dealloc", "[server]") {
   TEST_HEAP_START
 
@@ -330,3 +380,1681 @@ TEST_CASE("Parse parallel batch", "[server]") {
 
   TEST_HEAP_STOP
 }
+
+TEST_CASE("Freeze handlers", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler1, "testHandler1"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handlers_freeze(server));
+
+  // Registry is immutable now
+  TEST_ASSERT_EQUAL(1, aos_jrpc_server_handlers_freeze(server));
+  TEST_ASSERT_EQUAL(
+      1, aos_jrpc_server_handler_set(server, test_handler0, "testHandler2"));
+  TEST_ASSERT_EQUAL(1, aos_jrpc_server_handler_unset(server, "testHandler0"));
+
+  test_call(server, STRING_REQUEST_HANDLER0_VALID0);
+  test_call(server, STRING_REQUEST_HANDLER1_VALID0);
+  test_call(server, STRING_BATCH_VALID3);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_REQUEST_DEFERRED_VALID0                                         \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testDeferred\", \"id\":5}"
+
+TEST_CASE("Duplicate ids", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+
+  // Keep id 5 active
+  aos_future_t *future =
+      test_call_start(server, STRING_REQUEST_DEFERRED_VALID0);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+
+  // Same id is rejected, other ids are not affected
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32002", true);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID1, "-32002", false);
+
+  // Id is released once the request completes
+  test_handler_deferred_resolve();
+  test_call_check(future, NULL, false);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32002", false);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Shutdown", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {
+      .maxrequests = 10, .maxinputlen = 500, .shutdowncode = -32099};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+
+  // Keep a request in flight
+  aos_future_t *future =
+      test_call_start(server, STRING_REQUEST_DEFERRED_VALID0);
+
+  aos_future_t *shutdown_future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_shutdown)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(shutdown_future);
+  aos_jrpc_server_shutdown(server, shutdown_future);
+  TEST_ASSERT_FALSE(aos_isresolved(shutdown_future));
+
+  // New requests are rejected with the configured code
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID1, "-32099", true);
+
+  // Only one shutdown can be pending
+  aos_future_t *dup_future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_shutdown)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(dup_future);
+  aos_jrpc_server_shutdown(server, dup_future);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(dup_future)));
+  AOS_ARGS_T(aos_jrpc_server_shutdown) *dup_args = aos_args_get(dup_future);
+  TEST_ASSERT_EQUAL(1, dup_args->out_err);
+  aos_awaitable_free(dup_future);
+
+  // Shutdown completes with the last request in flight
+  test_handler_deferred_resolve();
+  test_call_check(future, NULL, false);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(shutdown_future)));
+  AOS_ARGS_T(aos_jrpc_server_shutdown) *shutdown_args =
+      aos_args_get(shutdown_future);
+  TEST_ASSERT_EQUAL(0, shutdown_args->out_err);
+  aos_awaitable_free(shutdown_future);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+static void test_task_output(char *data, void *ctx) {
+  printf("Task output: %s\n", data);
+  TEST_ASSERT_EQUAL(pdTRUE, xQueueSend(ctx, &data, portMAX_DELAY));
+}
+
+TEST_CASE("Task variant", "[server]") {
+  TEST_HEAP_START
+
+  QueueHandle_t outputs = xQueueCreate(4, sizeof(char *));
+  TEST_ASSERT_NOT_NULL(outputs);
+  aos_jrpc_server_config_t config = {
+      .maxrequests = 10,
+      .maxinputlen = 500,
+      .task = {.queuelen = 4,
+               .stacksize = 4096,
+               .core = -1,
+               .on_output = test_task_output,
+               .ctx = outputs}};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+  // Inputs are owned by the server once pushed
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_push(server, strdup(STRING_REQUEST_HANDLER0_VALID0)));
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_push(server, strdup(STRING_REQUEST_HANDLER0_VALID3)));
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_push(server, strdup(STRING_REQUEST_HANDLER0_VALID1)));
+
+  // Notifications produce no output
+  char *data = NULL;
+  for (size_t i = 0; i < 2; i++) {
+    TEST_ASSERT_EQUAL(pdTRUE,
+                      xQueueReceive(outputs, &data, pdMS_TO_TICKS(1000)));
+    free(data);
+  }
+  TEST_ASSERT_EQUAL(pdFALSE, xQueueReceive(outputs, &data, pdMS_TO_TICKS(100)));
+
+  aos_jrpc_server_free(server);
+  vQueueDelete(outputs);
+
+  // No task, nothing to push to
+  config = (aos_jrpc_server_config_t){.maxrequests = 10, .maxinputlen = 500};
+  server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  data = strdup(STRING_REQUEST_HANDLER0_VALID0);
+  TEST_ASSERT_EQUAL(1, aos_jrpc_server_push(server, data));
+  free(data);
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Parse requests of known length", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 100};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+  // Input is not NUL-terminated, bytes past the length are not read
+  const char data[] = STRING_REQUEST_HANDLER0_VALID0 "garbage";
+  const size_t lens[] = {strlen(STRING_REQUEST_HANDLER0_VALID0), sizeof(data)};
+  const char *expected[] = {"\"result\"", "-32700"};
+  for (size_t i = 0; i < 2; i++) {
+    aos_future_t *future =
+        AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call)(NULL, 0);
+    TEST_ASSERT_NOT_NULL(future);
+    aos_jrpc_server_call_len(server, data, lens[i], future);
+    test_call_check(future, expected[i], true);
+  }
+
+  // Too long, rejected before parsing
+  const char padded[128] = STRING_REQUEST_HANDLER0_VALID0;
+  aos_future_t *future = AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_jrpc_server_call_len(server, padded, sizeof(padded), future);
+  test_call_check(future, "-32000", true);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Request ids", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 200};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+  // Short IDs are kept in the request context, long ones are copied
+  const char *ids[] = {"5", "-1.5", "null", "\"abcdef\"",
+                       "\"abcdefghijklmnopqrstuvwxyz\""};
+  for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+    char data[200];
+    snprintf(data, sizeof(data),
+             "{\"jsonrpc\":\"2.0\",\"method\":\"testHandler0\",\"id\":%s}",
+             ids[i]);
+    char expected[64];
+    snprintf(expected, sizeof(expected), "\"id\":%s", ids[i]);
+    test_call_find(server, data, expected, true);
+  }
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Context caches", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10,
+                                     .maxinputlen = 200,
+                                     .parallel = true,
+                                     .batches = 1,
+                                     .batchitems = 1};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+  // Request contexts come from the cache, the batch is too long for it
+  const char *data[] = {STRING_REQUEST_HANDLER0_VALID0, STRING_BATCH_VALID1};
+  for (size_t i = 0; i < 2; i++) {
+    test_call_find(server, data[i], "\"result\"", true);
+  }
+
+  aos_jrpc_server_stats_t stats;
+  aos_jrpc_server_stats_get(server, &stats);
+  TEST_ASSERT_EQUAL(3, stats.requesthits);
+  TEST_ASSERT_EQUAL(0, stats.requestmisses);
+  TEST_ASSERT_EQUAL(0, stats.batchhits);
+  TEST_ASSERT_EQUAL(1, stats.batchmisses);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Error templates", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 200};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+
+  // Text errors match the printed cJSON ones, whatever the ID
+  const char *ids[] = {"5", "1.5", "null", "\"abc\"", "\"a\\\"b\""};
+  for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+    char data[200];
+    snprintf(data, sizeof(data),
+             "{\"jsonrpc\":\"2.0\",\"method\":\"missing\",\"id\":%s}", ids[i]);
+    cJSON *id = cJSON_Parse(ids[i]);
+    cJSON *error = aos_jrpc_message_error(id, -32601, "Method not found");
+    char *expected = cJSON_PrintUnformatted(error);
+    TEST_ASSERT_NOT_NULL(expected);
+    test_call_find(server, data, expected, true);
+    free(expected);
+    cJSON_Delete(error);
+    cJSON_Delete(id);
+  }
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Result writer", "[server]") {
+  TEST_HEAP_START
+
+  // Written results match the printed cJSON ones, from small to several
+  // times the first buffer guess
+  cJSON *results[] = {cJSON_CreateNumber(1), cJSON_CreateArray(),
+                      cJSON_CreateArray()};
+  for (size_t i = 0; i < 100; i++) {
+    cJSON_AddItemToArray(results[1], cJSON_CreateString("value"));
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    cJSON_AddItemToArray(results[2], cJSON_CreateNumber(i));
+  }
+  const char *ids[] = {"5", "-1.5", "123456789012", "\"abc\"", "\"a\\\"b\""};
+  for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+    cJSON *id = cJSON_Parse(ids[i]);
+    for (size_t j = 0; j < sizeof(results) / sizeof(results[0]); j++) {
+      cJSON *message = aos_jrpc_message_result(id, results[j]);
+      char *expected = cJSON_PrintUnformatted(message);
+      TEST_ASSERT_NOT_NULL(expected);
+      char *data = aos_jrpc_message_result_print(id, results[j]);
+      TEST_ASSERT_NOT_NULL(data);
+      TEST_ASSERT_EQUAL_STRING(expected, data);
+
+      // Caller buffers must fit the message and some slack
+      size_t len = strlen(expected);
+      char *buf = malloc(len + 6);
+      TEST_ASSERT_NOT_NULL(buf);
+      TEST_ASSERT_EQUAL(-1, aos_jrpc_message_result_write(id, results[j], buf,
+                                                          len));
+      TEST_ASSERT_EQUAL(len, aos_jrpc_message_result_write(id, results[j], buf,
+                                                           len + 6));
+      TEST_ASSERT_EQUAL_STRING(expected, buf);
+      free(buf);
+      free(data);
+      free(expected);
+      cJSON_Delete(message);
+    }
+    cJSON_Delete(id);
+  }
+  for (size_t j = 0; j < sizeof(results) / sizeof(results[0]); j++) {
+    cJSON_Delete(results[j]);
+  }
+
+  TEST_HEAP_STOP
+}
+
+static void test_handler_raw(cJSON *params, aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  // Echo the first parameter back as a serialized result
+  const char *raw = cJSON_GetStringValue(cJSON_GetArrayItem(params, 0));
+  args->out_raw = raw ? strdup(raw) : NULL;
+  aos_resolve(future);
+}
+
+TEST_CASE("Raw results", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 200};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  aos_jrpc_server_handler_config_t raw_config = {.handler = test_handler_raw};
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_register(server, "raw", &raw_config));
+  aos_jrpc_server_handler_config_t checked_config = {
+      .handler = test_handler_raw, .validateraw = true};
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_register(server, "checked", &checked_config));
+
+  // Serialized results are spliced verbatim, and checked when configured
+  const char *requests[] = {
+      "{\"jsonrpc\":\"2.0\",\"method\":\"raw\",\"params\":"
+      "[\"[1, {\\\"a\\\":true}]\"],\"id\":5}",
+      "{\"jsonrpc\":\"2.0\",\"method\":\"checked\",\"params\":"
+      "[\"{\\\"a\\\":[null]}\"],\"id\":\"x\"}",
+      "{\"jsonrpc\":\"2.0\",\"method\":\"checked\",\"params\":"
+      "[\"{\\\"a\\\":[nul]}\"],\"id\":6}"};
+  const char *expected[] = {
+      "{\"jsonrpc\":\"2.0\",\"id\":5,\"result\":[1, {\"a\":true}]}",
+      "{\"jsonrpc\":\"2.0\",\"id\":\"x\",\"result\":{\"a\":[null]}}",
+      "{\"jsonrpc\":\"2.0\",\"id\":6,\"error\":{\"code\":-32603,"
+      "\"message\":\"Internal error\"}}"};
+  for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+    test_call_find(server, requests[i], expected[i], true);
+  }
+
+  // cJSON responses carry them as raw items
+  cJSON *request = cJSON_Parse(requests[0]);
+  TEST_ASSERT_NOT_NULL(request);
+  aos_future_t *future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call_json)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_jrpc_server_call_json(server, request, future);
+  cJSON_Delete(request);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
+  TEST_ASSERT_NOT_NULL(args->out_response);
+  char *data = cJSON_PrintUnformatted(args->out_response);
+  TEST_ASSERT_NOT_NULL(data);
+  TEST_ASSERT_EQUAL_STRING(expected[0], data);
+  free(data);
+  cJSON_Delete(args->out_response);
+  aos_awaitable_free(future);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+typedef struct test_params_t {
+  int32_t a;
+  uint8_t b;
+  char *name;
+} test_params_t;
+
+static const aos_jrpc_server_param_t test_params[] = {
+    {.name = "a",
+     .type = AOS_JRPC_SERVER_PARAM_INT32,
+     .offset = offsetof(test_params_t, a),
+     .min = -100,
+     .max = 100},
+    {.name = "b",
+     .type = AOS_JRPC_SERVER_PARAM_UINT8,
+     .offset = offsetof(test_params_t, b)},
+    {.name = "name",
+     .type = AOS_JRPC_SERVER_PARAM_STR,
+     .offset = offsetof(test_params_t, name),
+     .optional = true,
+     .max = 8},
+};
+
+static void test_handler_bound(cJSON *params, aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  const test_params_t *bound = args->in_params;
+  size_t len = bound->name ? strlen(bound->name) : 0;
+  args->out_result = cJSON_CreateNumber(bound->a + bound->b + len);
+  aos_resolve(future);
+}
+
+static aos_future_t *test_handler_bound_future = NULL;
+static void test_handler_bound_deferred(cJSON *params, aos_future_t *future) {
+  test_handler_bound_future = future;
+}
+
+TEST_CASE("Parameter descriptors", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 200};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+
+  // Descriptors must fit the bound struct
+  aos_jrpc_server_handler_config_t handler_config = {
+      .handler = test_handler_bound,
+      .params = test_params,
+      .nparams = sizeof(test_params) / sizeof(test_params[0]),
+      .paramsize = offsetof(test_params_t, name)};
+  TEST_ASSERT_EQUAL(
+      1, aos_jrpc_server_handler_register(server, "bound", &handler_config));
+  handler_config.paramsize = sizeof(test_params_t);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_register(server, "bound", &handler_config));
+
+  // Positional and named params bind alike, mismatches never reach the
+  // handler
+  const char *params[] = {"[1,2]",
+                          "[1,2,\"abc\"]",
+                          "{\"b\":2,\"a\":1}",
+                          "{\"a\":1,\"name\":\"abcd\",\"b\":2}",
+                          "[1]",
+                          "[1,2,\"abc\",4]",
+                          "[101,2]",
+                          "[1,256]",
+                          "[1,\"2\"]",
+                          "[1,2,\"abcdefghi\"]",
+                          "{\"a\":1,\"b\":2,\"c\":3}",
+                          "{\"a\":1,\"a\":1,\"b\":2}",
+                          "5",
+                          "[1.7,2]",
+                          "[1,-0.5]"};
+  const char *expected[] = {
+      "\"result\":3",  "\"result\":6",  "\"result\":3",  "\"result\":7",
+      "-32602",        "-32602",        "-32602",        "-32602",
+      "-32602",        "-32602",        "-32602",        "-32602",
+      "-32602",        "-32602",        "-32602"};
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    char data[200];
+    snprintf(data, sizeof(data),
+             "{\"jsonrpc\":\"2.0\",\"method\":\"bound\",\"params\":%s,"
+             "\"id\":1}",
+             params[i]);
+    test_call_find(server, data, expected[i], true);
+  }
+
+  // Bound references stay valid until a deferred handler resolves, even though
+  // the request text is gone by then
+  handler_config.handler = test_handler_bound_deferred;
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(
+                           server, "boundDeferred", &handler_config));
+  aos_future_t *future = test_call_start(
+      server, "{\"jsonrpc\":\"2.0\",\"method\":\"boundDeferred\","
+              "\"params\":[1,2,\"abc\"],\"id\":1}");
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+  test_handler_bound(NULL, test_handler_bound_future);
+  test_call_check(future, "\"result\":6", true);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_STREAM0                                                         \
+  STRING_REQUEST_HANDLER0_VALID0 "\n" STRING_REQUEST_HANDLER0_VALID1           \
+  "[\"{01234567890123456789012345678901234567890123456789"                     \
+  "012345678901234567890123456789012345678901234567890123456789\"]"
+
+TEST_CASE("Feed fragmented input", "[server]") {
+  TEST_HEAP_START
+
+  QueueHandle_t outputs = xQueueCreate(4, sizeof(char *));
+  TEST_ASSERT_NOT_NULL(outputs);
+  aos_jrpc_server_config_t config = {
+      .maxrequests = 10,
+      .maxinputlen = 100,
+      .task = {.on_output = test_task_output, .ctx = outputs}};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+  // Requests are dispatched as soon as their last byte arrives
+  const char *stream = STRING_STREAM0;
+  for (size_t i = 0; stream[i]; i++) {
+    TEST_ASSERT_EQUAL(0, aos_jrpc_server_feed(server, &stream[i], 1));
+  }
+
+  // Requests over maxinputlen are skipped to their end
+  const char *expected[] = {"\"id\":5", "\"id\":\"abcdef\"", "-32000"};
+  char *data = NULL;
+  for (size_t i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(outputs, &data, 0));
+    TEST_ASSERT_NOT_NULL(strstr(data, expected[i]));
+    free(data);
+  }
+  TEST_ASSERT_EQUAL(pdFALSE, xQueueReceive(outputs, &data, 0));
+
+  aos_jrpc_server_free(server);
+  vQueueDelete(outputs);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_STREAM1 "\"a b\" \"x{\\\"y\" 12\"c d\"\n"
+
+TEST_CASE("Feed bare values", "[server]") {
+  TEST_HEAP_START
+
+  QueueHandle_t outputs = xQueueCreate(4, sizeof(char *));
+  TEST_ASSERT_NOT_NULL(outputs);
+  aos_jrpc_server_config_t config = {
+      .maxrequests = 10,
+      .maxinputlen = 100,
+      .task = {.on_output = test_task_output, .ctx = outputs}};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+
+  // Strings end at their closing quote, whatever they hold, other values at
+  // the next whitespace outside of quotes
+  const char *stream = STRING_STREAM1;
+  for (size_t i = 0; stream[i]; i++) {
+    TEST_ASSERT_EQUAL(0, aos_jrpc_server_feed(server, &stream[i], 1));
+  }
+
+  const char *expected[] = {"-32600", "-32600", "-32700"};
+  char *data = NULL;
+  for (size_t i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(outputs, &data, 0));
+    TEST_ASSERT_NOT_NULL(strstr(data, expected[i]));
+    free(data);
+  }
+  TEST_ASSERT_EQUAL(pdFALSE, xQueueReceive(outputs, &data, 0));
+
+  aos_jrpc_server_free(server);
+  vQueueDelete(outputs);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_BATCH_RENDEZVOUS0                                               \
+  "[{\"jsonrpc\": \"2.0\", \"method\":\"testRendezvous\", \"id\":1},"         \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testRendezvous\", \"id\":2}]"
+
+static atomic_uint test_rendezvous_arrived = 0;
+static void test_handler_rendezvous(cJSON *params, aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+
+  // Wait for the other item, which only arrives if both run at the same time
+  atomic_fetch_add(&test_rendezvous_arrived, 1);
+  bool met = false;
+  for (size_t i = 0; i < 500 && !met; i++) {
+    met = atomic_load(&test_rendezvous_arrived) >= 2;
+    if (!met) {
+      vTaskDelay(pdMS_TO_TICKS(10));
+    }
+  }
+  args->out_result = cJSON_CreateBool(met);
+  aos_resolve(future);
+}
+
+#define STRING_REQUEST_DEFERRED_VALID1                                         \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testDeferred\", \"id\":6}"
+
+TEST_CASE("Worker pool", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10,
+                                     .maxinputlen = 500,
+                                     .parallel = true,
+                                     .pool = {.workers = 2}};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  aos_jrpc_server_handler_config_t handler_config = {
+      .handler = test_handler_rendezvous, .pooled = true};
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(
+                           server, "testRendezvous", &handler_config));
+
+  // Both handlers run at the same time and meet each other
+  atomic_store(&test_rendezvous_arrived, 0);
+  test_call_find(server, STRING_BATCH_RENDEZVOUS0, "false", false);
+  atomic_store(&test_rendezvous_arrived, 0);
+  test_call_find(server, STRING_BATCH_RENDEZVOUS0, "true", true);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+// NOTE: Both methods hash to 0x9f49e8ce with 32-bit FNV-1a
+#define STRING_REQUEST_COLLIDING_VALID0                                        \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"method74294\", \"id\":1}"
+#define STRING_REQUEST_COLLIDING_VALID1                                        \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"method261610\", \"id\":1}"
+#define STRING_REQUEST_COLLIDING_INVALID0                                      \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"method0\", \"id\":1}"
+
+static void test_handler_one(cJSON *params, aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  args->out_result = cJSON_CreateNumber(1);
+  aos_resolve(future);
+}
+
+TEST_CASE("Freeze handlers with colliding hashes", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "method74294"));
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler_one, "method261610"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handlers_freeze(server));
+
+  // Both colliding methods are still told apart
+  test_call_find(server, STRING_REQUEST_COLLIDING_VALID0, "\"result\":0", true);
+  test_call_find(server, STRING_REQUEST_COLLIDING_VALID1, "\"result\":1", true);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "\"result\":0", true);
+  test_call_find(server, STRING_REQUEST_COLLIDING_INVALID0, "-32601", true);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_REQUEST_CHURN_VALID0                                            \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testChurn\", \"id\":1}"
+
+/**
+ * @brief Call a method being set and unset meanwhile from a spawned task,
+ * counting responses from either handler, missing method errors and anything
+ * else
+ */
+AOS_DEFINE(test_call_churn, aos_jrpc_server_t *, size_t, size_t, size_t, size_t)
+static void test_call_churn(aos_future_t *future) {
+  AOS_ARGS_T(test_call_churn) *args = aos_args_get(future);
+
+  for (size_t i = 0; i < args->in_iterations; i++) {
+    aos_future_t *call_future =
+        AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call)(NULL, 0);
+    TEST_ASSERT_NOT_NULL(call_future);
+    aos_jrpc_server_call(args->in_server, STRING_REQUEST_CHURN_VALID0,
+                         call_future);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(call_future)));
+    AOS_ARGS_T(aos_jrpc_server_call) *call_args = aos_args_get(call_future);
+    const char *data = call_args->out_data ? call_args->out_data : "";
+    if (strstr(data, "\"result\":0") || strstr(data, "\"result\":1")) {
+      args->out_found++;
+    } else if (strstr(data, "-32601")) {
+      args->out_missing++;
+    } else {
+      args->out_torn++;
+    }
+    free(call_args->out_data);
+    aos_awaitable_free(call_future);
+  }
+  aos_resolve(future);
+}
+
+/**
+ * @brief Replace and unset the churned method repeatedly from a spawned task
+ */
+AOS_DEFINE(test_set_churn, aos_jrpc_server_t *, size_t, size_t)
+static void test_set_churn(aos_future_t *future) {
+  AOS_ARGS_T(test_set_churn) *args = aos_args_get(future);
+
+  for (size_t i = 0; i < args->in_iterations; i++) {
+    args->out_failed +=
+        aos_jrpc_server_handler_set(args->in_server, test_handler0,
+                                    "testChurn") +
+        aos_jrpc_server_handler_set(args->in_server, test_handler_one,
+                                    "testChurn") +
+        aos_jrpc_server_handler_unset(args->in_server, "testChurn");
+  }
+  aos_resolve(future);
+}
+
+TEST_CASE("Set handlers while dispatching", "[server]") {
+  const size_t iterations = 200;
+  size_t baseline = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+
+  // Every call sees one of the handlers or none, never a torn or freed entry
+  aos_future_t *call_future =
+      AOS_AWAITABLE_ALLOC_T(test_call_churn)(server, iterations, 0, 0, 0);
+  TEST_ASSERT_NOT_NULL(call_future);
+  aos_future_t *set_future =
+      AOS_AWAITABLE_ALLOC_T(test_set_churn)(server, iterations, 0);
+  TEST_ASSERT_NOT_NULL(set_future);
+  aos_spawn_config_t spawn_config = {.stacksize = 4096};
+  aos_spawn(&spawn_config, test_call_churn, call_future);
+  aos_spawn(&spawn_config, test_set_churn, set_future);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(call_future)));
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(set_future)));
+  AOS_ARGS_T(test_call_churn) *call_args = aos_args_get(call_future);
+  AOS_ARGS_T(test_set_churn) *set_args = aos_args_get(set_future);
+  printf("%u found, %u missing\n", call_args->out_found,
+         call_args->out_missing);
+  TEST_ASSERT_EQUAL(0, call_args->out_torn);
+  TEST_ASSERT_EQUAL(iterations,
+                    call_args->out_found + call_args->out_missing);
+  TEST_ASSERT_EQUAL(0, set_args->out_failed);
+  aos_awaitable_free(call_future);
+  aos_awaitable_free(set_future);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+
+  // Every replaced registry was reclaimed, once spawned tasks are cleaned up
+  vTaskDelay(pdMS_TO_TICKS(100));
+  TEST_ASSERT_EQUAL(baseline, heap_caps_get_free_size(MALLOC_CAP_8BIT));
+}
+
+TEST_CASE("Method limits", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  aos_jrpc_server_handler_config_t deferred_config = {
+      .handler = test_handler_deferred, .maxconcurrent = 1};
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(
+                           server, "testDeferred", &deferred_config));
+  aos_jrpc_server_handler_config_t handler0_config = {
+      .handler = test_handler0, .rate = 1, .ratewindow = 200, .burst = 2};
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(
+                           server, "testHandler0", &handler0_config));
+
+  // A second concurrent call is rejected until the first one completes
+  aos_future_t *future =
+      test_call_start(server, STRING_REQUEST_DEFERRED_VALID0);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+  test_call_find(server, STRING_REQUEST_DEFERRED_VALID1, "-32004", true);
+  test_handler_deferred_resolve();
+  test_call_check(future, NULL, false);
+
+  // Burst is spent, then the bucket refills over time
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32004", false);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID1, "-32004", false);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32004", true);
+  vTaskDelay(pdMS_TO_TICKS(400));
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32004", false);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Rate limits refund rejected calls", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 1, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+  aos_jrpc_server_handler_config_t handler0_config = {
+      .handler = test_handler0, .rate = 1, .ratewindow = 60000};
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(
+                           server, "testHandler0", &handler0_config));
+
+  // A call rejected for lack of request slots leaves the bucket unchanged
+  aos_future_t *future =
+      test_call_start(server, STRING_REQUEST_DEFERRED_VALID0);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32001", true);
+  test_handler_deferred_resolve();
+  test_call_check(future, NULL, false);
+
+  // Its token is still there for the next call, and only that one
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "\"result\"", true);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32004", true);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_REQUEST_PRIORITY_VALID0                                         \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testHandler0\", \"priority\":1, "     \
+  "\"id\":7}"
+
+static aos_future_t *test_held_futures[4];
+static size_t test_held_count = 0;
+static void test_handler_held(cJSON *params, aos_future_t *future) {
+  test_held_futures[test_held_count++] = future;
+}
+
+TEST_CASE("Request limiter", "[server]") {
+  TEST_HEAP_START
+
+  const size_t maxrequests = sizeof(test_held_futures) / sizeof(void *);
+  aos_jrpc_server_config_t config = {.maxrequests = maxrequests,
+                                     .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler_held, "testHeld"));
+
+  // Exactly maxrequests requests are in progress at once
+  aos_future_t *futures[sizeof(test_held_futures) / sizeof(void *)];
+  test_held_count = 0;
+  for (size_t i = 0; i < maxrequests; i++) {
+    char data[100];
+    snprintf(data, sizeof(data),
+             "{\"jsonrpc\":\"2.0\",\"method\":\"testHeld\",\"id\":%u}", i);
+    futures[i] = test_call_start(server, data);
+    TEST_ASSERT_FALSE(aos_isresolved(futures[i]));
+  }
+  TEST_ASSERT_EQUAL(maxrequests, test_held_count);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32001", true);
+
+  // Completed requests give their slot back
+  for (size_t i = 0; i < maxrequests; i++) {
+    AOS_ARGS_T(aos_jrpc_server_handler) *handler_args =
+        aos_args_get(test_held_futures[i]);
+    handler_args->out_result = cJSON_CreateNumber(i);
+    aos_resolve(test_held_futures[i]);
+    test_call_check(futures[i], "\"result\"", true);
+  }
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32001", false);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Priority reserved slots", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 2,
+                                     .maxinputlen = 500,
+                                     .reserved = 1,
+                                     .priorityfield = "priority"};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+  aos_jrpc_server_handler_config_t handler_config = {
+      .handler = test_handler0, .priority = AOS_JRPC_SERVER_PRIORITY_HIGH};
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(
+                           server, "testHandlerHigh", &handler_config));
+
+  // Normal requests cannot take the reserved slot, high priority ones can
+  aos_future_t *future =
+      test_call_start(server, STRING_REQUEST_DEFERRED_VALID0);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32001", true);
+  test_call_find(server, STRING_REQUEST_PRIORITY_VALID0, "-32001", false);
+  test_call_find(server,
+                 "{\"jsonrpc\": \"2.0\", \"method\":\"testHandlerHigh\", "
+                 "\"id\":8}",
+                 "-32001", false);
+  test_handler_deferred_resolve();
+  test_call_check(future, NULL, false);
+
+  // Reserved slots must leave room for normal requests
+  config.reserved = 2;
+  TEST_ASSERT_NULL(aos_jrpc_server_alloc(&config));
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Handler timeout", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {
+      .maxrequests = 10, .maxinputlen = 500, .timeout = 100};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+
+  // A handler that does not resolve in time gets an error response
+  test_call_find(server, STRING_REQUEST_DEFERRED_VALID0, "-32005", true);
+
+  // The late result is dropped and the id can be used again
+  test_handler_deferred_resolve();
+  aos_future_t *future =
+      test_call_start(server, STRING_REQUEST_DEFERRED_VALID0);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+  test_handler_deferred_resolve();
+  test_call_check(future, "-32005", false);
+
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_BATCH_TIMEOUT0                                                  \
+  "[{\"jsonrpc\": \"2.0\", \"method\":\"testDeferred\", \"id\":1},"           \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testTaskName\", \"id\":2}]"
+
+static char test_task_name[configMAX_TASK_NAME_LEN];
+static void test_handler_task_name(cJSON *params, aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  snprintf(test_task_name, sizeof(test_task_name), "%s", pcTaskGetName(NULL));
+  args->out_result = cJSON_CreateNumber(0);
+  aos_resolve(future);
+}
+
+TEST_CASE("Handler timeout in sequential batch", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  aos_jrpc_server_handler_config_t handler_config = {
+      .handler = test_handler_deferred, .timeout = 100};
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(server, "testDeferred",
+                                                        &handler_config));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_task_name, "testTaskName"));
+
+  // The item after the timed out one is dispatched by the reaper, never by
+  // the shared timer task
+  test_task_name[0] = '\0';
+  test_call_find(server, STRING_BATCH_TIMEOUT0, "-32005", true);
+  printf("Next item ran on: %s\n", test_task_name);
+  TEST_ASSERT_NOT_EQUAL(0, strlen(test_task_name));
+  TEST_ASSERT_NOT_EQUAL(0, strcmp(test_task_name, "esp_timer"));
+
+  test_handler_deferred_resolve();
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_REQUEST_BUDGET_INVALID0                                         \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testHandler0\", \"budget\":0, "       \
+  "\"id\":1}"
+#define STRING_REQUEST_DELAYED_VALID0                                          \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testHandlerDelayed\", \"id\":1}"
+#define STRING_REQUEST_BUDGET_VALID0                                           \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testHandlerDelayed\", \"budget\":100, " \
+  "\"id\":2}"
+#define STRING_BATCH_BUDGET0                                                   \
+  "[" STRING_REQUEST_DELAYED_VALID0 "," STRING_REQUEST_BUDGET_VALID0 "]"
+
+static size_t test_delayed_calls = 0;
+static void test_handler_delayed_counted(cJSON *params, aos_future_t *future) {
+  test_delayed_calls++;
+  test_handler_delayed(params, future);
+}
+
+TEST_CASE("Client deadlines", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10,
+                                     .maxinputlen = 500,
+                                     .deadlinefield = "budget",
+                                     .parallel = true,
+                                     .pool = {.workers = 1}};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  aos_jrpc_server_handler_config_t handler_config = {
+      .handler = test_handler_delayed_counted, .pooled = true};
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(
+                           server, "testHandlerDelayed", &handler_config));
+
+  // Expired on arrival
+  test_call_find(server, STRING_REQUEST_BUDGET_INVALID0, "-32006", true);
+  test_call_find(server, STRING_REQUEST_HANDLER0_VALID0, "-32006", false);
+
+  // Expired while waiting for the only worker, the handler is skipped
+  test_delayed_calls = 0;
+  test_call_find(server, STRING_BATCH_BUDGET0, "-32006", true);
+  TEST_ASSERT_EQUAL(1, test_delayed_calls);
+
+  aos_jrpc_server_free(server);
+
+  // Expired while waiting in the task queue behind a slow request
+  QueueHandle_t outputs = xQueueCreate(4, sizeof(char *));
+  TEST_ASSERT_NOT_NULL(outputs);
+  config = (aos_jrpc_server_config_t){
+      .maxrequests = 10,
+      .maxinputlen = 500,
+      .deadlinefield = "budget",
+      .task = {.queuelen = 4, .on_output = test_task_output, .ctx = outputs}};
+  server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_delayed_counted,
+                           "testHandlerDelayed"));
+  test_delayed_calls = 0;
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_push(server, strdup(STRING_REQUEST_DELAYED_VALID0)));
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_push(server, strdup(STRING_REQUEST_BUDGET_VALID0)));
+
+  char *data = NULL;
+  TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(outputs, &data, pdMS_TO_TICKS(2000)));
+  TEST_ASSERT_NULL(strstr(data, "-32006"));
+  free(data);
+  TEST_ASSERT_EQUAL(pdTRUE, xQueueReceive(outputs, &data, pdMS_TO_TICKS(2000)));
+  TEST_ASSERT_NOT_NULL(strstr(data, "-32006"));
+  free(data);
+  TEST_ASSERT_EQUAL(1, test_delayed_calls);
+
+  aos_jrpc_server_free(server);
+  vQueueDelete(outputs);
+
+  TEST_HEAP_STOP
+}
+
+#define STRING_REQUEST_HEAP_VALID0                                             \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testHeap\", \"params\":{\"padding\":"   \
+  "\"01234567890123456789012345678901234567890123456789\"}, \"id\":1}"
+#define STRING_BATCH_DEFERRED0                                                 \
+  "[" STRING_REQUEST_DEFERRED_VALID0 "," STRING_REQUEST_HANDLER0_VALID1 "]"
+
+TEST_CASE("Sequential batch with pending item", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+
+  // Input is freed while the first item is still pending
+  cJSON *request = cJSON_Parse(STRING_BATCH_DEFERRED0);
+  TEST_ASSERT_NOT_NULL(request);
+  aos_future_t *future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call_json)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_jrpc_server_call_json(server, request, future);
+  cJSON_Delete(request);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+
+  test_handler_deferred_resolve();
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
+  TEST_ASSERT_EQUAL(2, cJSON_GetArraySize(args->out_response));
+  cJSON_Delete(args->out_response);
+  aos_awaitable_free(future);
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Parallel batch order", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {
+      .maxrequests = 10, .maxinputlen = 500, .parallel = true};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+
+  // Second item completes first, responses still follow request order
+  aos_future_t *future = test_call_start(server, STRING_BATCH_DEFERRED0);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+
+  test_handler_deferred_resolve();
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  AOS_ARGS_T(aos_jrpc_server_call) *args = aos_args_get(future);
+  cJSON *response = cJSON_Parse(args->out_data);
+  TEST_ASSERT_EQUAL(2, cJSON_GetArraySize(response));
+  cJSON *id = cJSON_GetObjectItem(cJSON_GetArrayItem(response, 0), "id");
+  TEST_ASSERT_TRUE(cJSON_IsNumber(id));
+  TEST_ASSERT_EQUAL(5, id->valueint);
+  cJSON_Delete(response);
+  free(args->out_data);
+  aos_awaitable_free(future);
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+TEST_CASE("Parallel batch window", "[server]") {
+  TEST_HEAP_START
+
+  // Without a window the second item would be rejected with -32001
+  aos_jrpc_server_config_t config = {
+      .maxrequests = 1, .maxinputlen = 500, .parallel = true, .window = 1};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(
+                           server, test_handler_deferred, "testDeferred"));
+
+  // Input is freed while the rest of the batch waits for the window
+  cJSON *request = cJSON_Parse(STRING_BATCH_DEFERRED0);
+  TEST_ASSERT_NOT_NULL(request);
+  aos_future_t *future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call_json)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_jrpc_server_call_json(server, request, future);
+  cJSON_Delete(request);
+  TEST_ASSERT_FALSE(aos_isresolved(future));
+
+  test_handler_deferred_resolve();
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
+  TEST_ASSERT_EQUAL(2, cJSON_GetArraySize(args->out_response));
+  char *response = cJSON_PrintUnformatted(args->out_response);
+  TEST_ASSERT_NOT_NULL(response);
+  TEST_ASSERT_NULL(strstr(response, "-32001"));
+  free(response);
+  cJSON_Delete(args->out_response);
+  aos_awaitable_free(future);
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+static void test_handler_quiet(cJSON *params, aos_future_t *future) {
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  args->out_result = cJSON_CreateNumber(0);
+  aos_resolve(future);
+}
+
+TEST_CASE("Sequential batch stress", "[server][stress]") {
+  // NOTE: Needs about 400 KB of heap for item references, meant for the Linux
+  // target or PSRAM
+  const size_t items = 10000;
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_set(server, test_handler_quiet,
+                                                   "testQuiet"));
+
+  // Reference the same notification over and over, then a request at the end
+  cJSON *notification =
+      cJSON_Parse("{\"jsonrpc\": \"2.0\", \"method\":\"testQuiet\"}");
+  cJSON *last =
+      cJSON_Parse("{\"jsonrpc\": \"2.0\", \"method\":\"testQuiet\", \"id\":1}");
+  cJSON *request = cJSON_CreateArray();
+  TEST_ASSERT_NOT_NULL(notification);
+  TEST_ASSERT_NOT_NULL(last);
+  TEST_ASSERT_NOT_NULL(request);
+  for (size_t i = 0; i < items - 1; i++) {
+    TEST_ASSERT_TRUE(cJSON_AddItemReferenceToArray(request, notification));
+  }
+  TEST_ASSERT_TRUE(cJSON_AddItemToArray(request, last));
+
+  // Synchronous completions must not grow the stack of a small task
+  aos_future_t *future = AOS_AWAITABLE_ALLOC_T(test_call_json_spawnable)(
+      server, request, NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_spawn_config_t spawn_config = {.stacksize = 4096};
+  int64_t start = esp_timer_get_time();
+  aos_spawn(&spawn_config, test_call_json_spawnable, future);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  printf("%u items: %lld us\n", items, esp_timer_get_time() - start);
+
+  AOS_ARGS_T(test_call_json_spawnable) *args = aos_args_get(future);
+  TEST_ASSERT_EQUAL(0, args->out_err);
+  TEST_ASSERT_EQUAL(1, cJSON_GetArraySize(args->out_response));
+  cJSON_Delete(args->out_response);
+  aos_awaitable_free(future);
+  cJSON_Delete(request);
+  cJSON_Delete(notification);
+  aos_jrpc_server_free(server);
+}
+
+static size_t test_heap_min_free;
+static void test_handler_heap(cJSON *params, aos_future_t *future) {
+  size_t free_size = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  if (free_size < test_heap_min_free) {
+    test_heap_min_free = free_size;
+  }
+  test_handler0(params, future);
+}
+
+TEST_CASE("Sequential batch peak heap", "[server]") {
+  TEST_HEAP_START
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10,
+                                     .maxinputlen = 32 * 1024};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler_heap, "testHeap"));
+
+  // Roughly 16 KB of requests
+  cJSON *request = cJSON_CreateArray();
+  TEST_ASSERT_NOT_NULL(request);
+  for (size_t i = 0; i < 160; i++) {
+    cJSON *item = cJSON_Parse(STRING_REQUEST_HEAP_VALID0);
+    TEST_ASSERT_NOT_NULL(item);
+    TEST_ASSERT_TRUE(cJSON_AddItemToArray(request, item));
+  }
+
+  size_t free_size = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  test_heap_min_free = free_size;
+  aos_future_t *future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call_json)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  aos_jrpc_server_call_json(server, request, future);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+  printf("Sequential batch peak heap: %u bytes\n",
+         free_size - test_heap_min_free);
+
+  AOS_ARGS_T(aos_jrpc_server_call_json) *args = aos_args_get(future);
+  TEST_ASSERT_EQUAL(160, cJSON_GetArraySize(args->out_response));
+  cJSON_Delete(args->out_response);
+  aos_awaitable_free(future);
+  cJSON_Delete(request);
+  aos_jrpc_server_free(server);
+
+  TEST_HEAP_STOP
+}
+
+static int64_t test_dispatch_time(aos_jrpc_server_t *server, cJSON *request,
+                                  size_t iterations) {
+  int64_t start = esp_timer_get_time();
+  for (size_t i = 0; i < iterations; i++) {
+    aos_future_t *future =
+        AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call_json)(NULL, 0);
+    TEST_ASSERT_NOT_NULL(future);
+    aos_jrpc_server_call_json(server, request, future);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(future)));
+    aos_awaitable_free(future);
+  }
+  return (esp_timer_get_time() - start) / iterations;
+}
+
+TEST_CASE("Handler lookup benchmark", "[server][benchmark]") {
+  const size_t methods_counts[] = {10, 100, 1000};
+  const size_t iterations = 1000;
+  char method[32];
+
+  for (size_t i = 0; i < sizeof(methods_counts) / sizeof(size_t); i++) {
+    aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 500};
+    aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+    TEST_ASSERT_NOT_NULL(server);
+    for (size_t j = 0; j < methods_counts[i]; j++) {
+      snprintf(method, sizeof(method), "benchmarkMethod%u", j);
+      TEST_ASSERT_EQUAL(
+          0, aos_jrpc_server_handler_set(server, test_handler0, method));
+    }
+
+    // Call the last registered method, worst case for a linear registry
+    cJSON *request = cJSON_CreateObject();
+    TEST_ASSERT_NOT_NULL(request);
+    TEST_ASSERT_NOT_NULL(cJSON_AddStringToObject(request, "jsonrpc", "2.0"));
+    TEST_ASSERT_NOT_NULL(cJSON_AddStringToObject(request, "method", method));
+
+    printf("Dispatch with %u methods: %lld us per notification\n",
+           methods_counts[i], test_dispatch_time(server, request, iterations));
+    TEST_ASSERT_EQUAL(0, aos_jrpc_server_handlers_freeze(server));
+    printf("Dispatch with %u frozen methods: %lld us per notification\n",
+           methods_counts[i], test_dispatch_time(server, request, iterations));
+
+    cJSON_Delete(request);
+    aos_jrpc_server_free(server);
+  }
+}
+
+/**
+ * @brief Call the server repeatedly from a spawned task, counting requests
+ * rejected for exceeding maxrequests
+ */
+AOS_DEFINE(test_call_loop, aos_jrpc_server_t *, const char *, size_t, size_t)
+static void test_call_loop(aos_future_t *future) {
+  AOS_ARGS_T(test_call_loop) *args = aos_args_get(future);
+
+  for (size_t i = 0; i < args->in_iterations; i++) {
+    aos_future_t *call_future =
+        AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call)(NULL, 0);
+    TEST_ASSERT_NOT_NULL(call_future);
+    aos_jrpc_server_call(args->in_server, args->in_request, call_future);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(call_future)));
+    AOS_ARGS_T(aos_jrpc_server_call) *call_args = aos_args_get(call_future);
+    TEST_ASSERT_EQUAL(0, call_args->out_err);
+    if (call_args->out_data && strstr(call_args->out_data, "-32001")) {
+      args->out_rejected++;
+    }
+    free(call_args->out_data);
+    aos_awaitable_free(call_future);
+  }
+  aos_resolve(future);
+}
+
+TEST_CASE("Admission contention benchmark", "[server][benchmark]") {
+  const size_t tasks = 8;
+  const size_t iterations = 200;
+  aos_future_t *futures[8] = {NULL};
+
+  aos_jrpc_server_config_t config = {.maxrequests = 4, .maxinputlen = 500};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+  int64_t start = esp_timer_get_time();
+  for (size_t i = 0; i < tasks; i++) {
+    futures[i] = AOS_AWAITABLE_ALLOC_T(test_call_loop)(
+        server, STRING_REQUEST_HANDLER0_VALID0, iterations, 0);
+    TEST_ASSERT_NOT_NULL(futures[i]);
+    aos_spawn_config_t spawn_config = {.stacksize = 4096};
+    aos_spawn(&spawn_config, test_call_loop, futures[i]);
+  }
+  size_t rejected = 0;
+  for (size_t i = 0; i < tasks; i++) {
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(futures[i])));
+    AOS_ARGS_T(test_call_loop) *args = aos_args_get(futures[i]);
+    rejected += args->out_rejected;
+    aos_awaitable_free(futures[i]);
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  printf("%u tasks, %u calls each: %lld us per call, %u rejected\n", tasks,
+         iterations, elapsed / (tasks * iterations), rejected);
+
+  aos_jrpc_server_free(server);
+}
+
+static int64_t test_priority_sent[256];
+static int64_t test_priority_latency[256];
+
+static void test_handler_busy(cJSON *params, aos_future_t *future) {
+  int64_t until = esp_timer_get_time() + 2000;
+  while (esp_timer_get_time() < until) {
+  }
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  args->out_result = cJSON_CreateNumber(0);
+  aos_resolve(future);
+}
+
+static void test_priority_output(char *data, void *ctx) {
+  cJSON *response = cJSON_Parse(data);
+  cJSON *id = cJSON_GetObjectItemCaseSensitive(response, "id");
+  if (cJSON_IsNumber(id)) {
+    test_priority_latency[id->valueint] =
+        esp_timer_get_time() - test_priority_sent[id->valueint];
+  }
+  cJSON_Delete(response);
+  free(data);
+  xSemaphoreGive(ctx);
+}
+
+static int test_priority_cmp(const void *a, const void *b) {
+  int64_t latency_a = *(const int64_t *)a;
+  int64_t latency_b = *(const int64_t *)b;
+  return latency_a < latency_b ? -1 : latency_a > latency_b;
+}
+
+TEST_CASE("Priority latency benchmark", "[server][benchmark]") {
+  const size_t requests = 256;
+  const size_t every = 8; // One control request every this many
+  int64_t latencies[32];
+
+  // Control requests take the normal lane first, then the high priority one
+  for (size_t high = 0; high < 2; high++) {
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(requests, 0);
+    TEST_ASSERT_NOT_NULL(done);
+    aos_jrpc_server_config_t config = {
+        .maxrequests = 64,
+        .maxinputlen = 500,
+        .reserved = 4,
+        .task = {.queuelen = requests, .on_output = test_priority_output,
+                 .ctx = done},
+        .pool = {.workers = 2}};
+    aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+    TEST_ASSERT_NOT_NULL(server);
+    aos_jrpc_server_handler_config_t bulk_config = {
+        .handler = test_handler_busy, .pooled = true};
+    TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(server, "bulk",
+                                                          &bulk_config));
+    aos_jrpc_server_handler_config_t control_config = {
+        .handler = test_handler0,
+        .pooled = true,
+        .priority = high ? AOS_JRPC_SERVER_PRIORITY_HIGH
+                         : AOS_JRPC_SERVER_PRIORITY_NORMAL};
+    TEST_ASSERT_EQUAL(0, aos_jrpc_server_handler_register(server, "control",
+                                                          &control_config));
+
+    // Keep the workers congested with bulk requests
+    size_t controls = 0;
+    for (size_t i = 0; i < requests; i++) {
+      bool control = i % every == every - 1;
+      char data[80];
+      snprintf(data, sizeof(data),
+               "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"id\":%u}",
+               control ? "control" : "bulk", i);
+      test_priority_sent[i] = esp_timer_get_time();
+      TEST_ASSERT_EQUAL(0, aos_jrpc_server_push_priority(
+                               server, strdup(data),
+                               control ? control_config.priority
+                                       : AOS_JRPC_SERVER_PRIORITY_NORMAL));
+      controls += control;
+    }
+    for (size_t i = 0; i < requests; i++) {
+      TEST_ASSERT_EQUAL(pdTRUE, xSemaphoreTake(done, pdMS_TO_TICKS(10000)));
+    }
+    for (size_t i = 0; i < controls; i++) {
+      latencies[i] = test_priority_latency[i * every + every - 1];
+    }
+    qsort(latencies, controls, sizeof(int64_t), test_priority_cmp);
+    printf("%s control requests: p50 %lld us, p99 %lld us\n",
+           high ? "High priority" : "Normal priority", latencies[controls / 2],
+           latencies[controls * 99 / 100]);
+
+    aos_jrpc_server_free(server);
+    vSemaphoreDelete(done);
+  }
+}
+
+/**
+ * @brief Count the allocations made by a call served by an inline handler
+ */
+static size_t test_call_allocs(aos_jrpc_server_t *server, const char *data) {
+  aos_future_t *future = AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(future);
+  ESP_ERROR_CHECK(heap_trace_start(HEAP_TRACE_ALL));
+  aos_jrpc_server_call(server, data, future);
+  ESP_ERROR_CHECK(heap_trace_stop());
+  size_t allocs = heap_trace_get_count();
+  test_call_check(future, NULL, false);
+  return allocs;
+}
+
+static void *test_arena_kept[1000];
+static size_t test_arena_kept_count = 0;
+static void test_handler_keep(cJSON *params, aos_future_t *future) {
+  // Long-lived allocation landing among the request ones
+  AOS_ARGS_T(aos_jrpc_server_handler) *args = aos_args_get(future);
+  test_arena_kept[test_arena_kept_count++] = malloc(16);
+  args->out_result = cJSON_CreateNumber(0);
+  aos_resolve(future);
+}
+
+TEST_CASE("Request arena benchmark", "[server][benchmark]") {
+  const size_t iterations = sizeof(test_arena_kept) / sizeof(void *);
+  char data[1024];
+  int len = snprintf(data, sizeof(data),
+                     "{\"jsonrpc\":\"2.0\",\"method\":\"keep\",\"id\":1,"
+                     "\"params\":{");
+  for (size_t i = 0; i < 20; i++) {
+    len += snprintf(&data[len], sizeof(data) - len,
+                    "%s\"key%u\":[%u,\"value%u\"]", i ? "," : "", i, i, i);
+  }
+  snprintf(&data[len], sizeof(data) - len, "}}");
+
+  // Heap first, then the arena. The hooks stay installed for the test app.
+  size_t allocs[2] = {0};
+  size_t free_size[2] = {0};
+  size_t largest[2] = {0};
+  int64_t elapsed[2] = {0};
+  for (size_t i = 0; i < 2; i++) {
+    if (i) {
+      aos_jrpc_server_arena_install();
+    }
+    aos_jrpc_server_config_t config = {
+        .maxrequests = 10, .maxinputlen = 1024, .arena = i ? 1024 : 0};
+    aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+    TEST_ASSERT_NOT_NULL(server);
+    TEST_ASSERT_EQUAL(
+        0, aos_jrpc_server_handler_set(server, test_handler_keep, "keep"));
+
+    test_arena_kept_count = 0;
+    allocs[i] = test_call_allocs(server, data);
+    int64_t start = esp_timer_get_time();
+    for (size_t j = 1; j < iterations; j++) {
+      test_call_check(test_call_start(server, data), NULL, false);
+    }
+    elapsed[i] = (esp_timer_get_time() - start) / (iterations - 1);
+
+    // Holes left between long-lived allocations
+    free_size[i] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    largest[i] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+    for (size_t j = 0; j < test_arena_kept_count; j++) {
+      free(test_arena_kept[j]);
+    }
+    aos_jrpc_server_free(server);
+  }
+  for (size_t i = 0; i < 2; i++) {
+    printf("%s: %u allocations and %lld us per request, %u bytes free, "
+           "largest free block %u bytes (%u%% fragmentation)\n",
+           i ? "Arena" : "Heap ", allocs[i], elapsed[i], free_size[i],
+           largest[i], 100 - largest[i] * 100 / free_size[i]);
+  }
+
+  // Parse trees take a block instead of a node each, and no longer leave
+  // holes between the long-lived allocations
+  TEST_ASSERT_LESS_THAN(allocs[0], allocs[1]);
+  TEST_ASSERT_GREATER_THAN(largest[0], largest[1]);
+}
+
+TEST_CASE("Malformed input benchmark", "[server][benchmark]") {
+  const size_t iterations = 1000;
+  const char *data[] = {"{\"jsonrpc\":\"2.0\",\"method\":",
+                        "{\"jsonrpc\":\"2.0\",\"method\":\"missing\",\"id\":1}",
+                        "{\"jsonrpc\":\"1.0\",\"id\":1}"};
+  const char *names[] = {"Parse error", "Method not found", "Invalid Request"};
+
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 200};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+
+  for (size_t i = 0; i < sizeof(data) / sizeof(data[0]); i++) {
+    int64_t start = esp_timer_get_time();
+    for (size_t j = 0; j < iterations; j++) {
+      test_call_check(test_call_start(server, data[i]), NULL, false);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    printf("%s: %lld us per request\n", names[i], elapsed / iterations);
+  }
+
+  aos_jrpc_server_free(server);
+}
+
+#define STRING_REQUEST_HANDLER0_LONGID0                                        \
+  "{\"jsonrpc\": \"2.0\", \"method\":\"testHandler0\", "                      \
+  "\"id\":\"abcdefghijklmnopqrstuvwxyz\"}"
+
+TEST_CASE("Request allocations benchmark", "[server][benchmark]") {
+  aos_jrpc_server_config_t config = {.maxrequests = 10, .maxinputlen = 200};
+  aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+  TEST_ASSERT_NOT_NULL(server);
+  TEST_ASSERT_EQUAL(
+      0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+  // What remains is the parse tree, the handler result, the response print
+  // and the futures AsyncRTOS allocates
+  size_t numeric = test_call_allocs(server, STRING_REQUEST_HANDLER0_VALID0);
+  size_t string = test_call_allocs(server, STRING_REQUEST_HANDLER0_VALID1);
+  size_t longid = test_call_allocs(server, STRING_REQUEST_HANDLER0_LONGID0);
+  printf("Allocations per request: %u with a numeric id, %u with a short "
+         "string id, %u with a long string id\n",
+         numeric, string, longid);
+
+  // Short ids are copied into the request context, only parsing the string
+  // allocates. Longer ones are duplicated.
+  TEST_ASSERT_LESS_OR_EQUAL(numeric + 1, string);
+  TEST_ASSERT_GREATER_THAN(string, longid);
+
+  aos_jrpc_server_free(server);
+}
+
+TEST_CASE("Context cache allocations benchmark", "[server][benchmark]") {
+  // The same batch with its context cached, then too long for the cache
+  size_t allocs[2] = {0};
+  for (size_t i = 0; i < 2; i++) {
+    aos_jrpc_server_config_t config = {.maxrequests = 10,
+                                       .maxinputlen = 200,
+                                       .parallel = true,
+                                       .batches = 1,
+                                       .batchitems = i ? 1 : 2};
+    aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+    TEST_ASSERT_NOT_NULL(server);
+    TEST_ASSERT_EQUAL(
+        0, aos_jrpc_server_handler_set(server, test_handler0, "testHandler0"));
+
+    test_call_allocs(server, STRING_BATCH_VALID1); // Warm up
+    allocs[i] = test_call_allocs(server, STRING_BATCH_VALID1);
+    aos_jrpc_server_stats_t stats;
+    aos_jrpc_server_stats_get(server, &stats);
+    printf("%s: %u allocations per batch, %u request context misses, %u "
+           "batch context misses\n",
+           i ? "Heap batch context" : "Cached batch context", allocs[i],
+           stats.requestmisses, stats.batchmisses);
+    TEST_ASSERT_EQUAL(0, stats.requestmisses);
+    TEST_ASSERT_EQUAL(i ? 2 : 0, stats.batchmisses);
+
+    aos_jrpc_server_free(server);
+  }
+
+  // Parse trees, results, response prints and futures are still allocated
+  TEST_ASSERT_LESS_THAN(allocs[1], allocs[0]);
+}
+
+#define STRING_REQUEST_STRPARAMS(method)                                       \
+  "{\"jsonrpc\":\"2.0\",\"method\":\"" method "\","                            \
+  "\"params\":[1,2,\"abcdefgh\"],\"id\":1}"
+
+TEST_CASE("Parameter binding benchmark", "[server][benchmark]") {
+  // The same string params unbound, then bound with strings copied into the
+  // request context, then into a block of their own
+  size_t allocs[3] = {0};
+  for (size_t i = 0; i < 2; i++) {
+    aos_jrpc_server_config_t config = {
+        .maxrequests = 10,
+        .maxinputlen = 200,
+        .paramspace = i ? sizeof(test_params_t) : 0};
+    aos_jrpc_server_t *server = aos_jrpc_server_alloc(&config);
+    TEST_ASSERT_NOT_NULL(server);
+    TEST_ASSERT_EQUAL(
+        0, aos_jrpc_server_handler_set(server, test_handler0, "unbound"));
+    aos_jrpc_server_handler_config_t handler_config = {
+        .handler = test_handler_bound,
+        .params = test_params,
+        .nparams = sizeof(test_params) / sizeof(test_params[0]),
+        .paramsize = sizeof(test_params_t)};
+    TEST_ASSERT_EQUAL(
+        0, aos_jrpc_server_handler_register(server, "bound", &handler_config));
+
+    test_call_allocs(server, STRING_REQUEST_STRPARAMS("unbound")); // Warm up
+    if (!i) {
+      allocs[0] = test_call_allocs(server, STRING_REQUEST_STRPARAMS("unbound"));
+    }
+    allocs[i + 1] = test_call_allocs(server, STRING_REQUEST_STRPARAMS("bound"));
+    aos_jrpc_server_stats_t stats;
+    aos_jrpc_server_stats_get(server, &stats);
+    TEST_ASSERT_EQUAL(0, stats.requestmisses);
+
+    aos_jrpc_server_free(server);
+  }
+  printf("Allocations per request: %u unbound, %u bound, %u bound with "
+         "strings not fitting the context\n",
+         allocs[0], allocs[1], allocs[2]);
+
+  // Binding takes no allocation while the strings fit the context, a single
+  // block otherwise
+  TEST_ASSERT_EQUAL(allocs[0], allocs[1]);
+  TEST_ASSERT_EQUAL(allocs[1] + 1, allocs[2]);
+}
+
+/**
+ * @brief Call the server with a cJSON request from a spawned task
+ */
+AOS_DEFINE(test_call_json_spawnable, aos_jrpc_server_t *, cJSON *, cJSON *,
+           unsigned int)
+static void test_call_json_spawnable(aos_future_t *future) {
+  AOS_ARGS_T(test_call_json_spawnable) *args = aos_args_get(future);
+
+  aos_future_t *call_future =
+      AOS_AWAITABLE_ALLOC_T(aos_jrpc_server_call_json)(NULL, 0);
+  TEST_ASSERT_NOT_NULL(call_future);
+  aos_jrpc_server_call_json(args->in_server, args->in_request, call_future);
+  TEST_ASSERT_TRUE(aos_isresolved(aos_await(call_future)));
+  AOS_ARGS_T(aos_jrpc_server_call_json) *call_args =
+      aos_args_get(call_future);
+  args->out_response = call_args->out_response;
+  args->out_err = call_args->out_err;
+  aos_awaitable_free(call_future);
+
+  aos_resolve(future);
+}